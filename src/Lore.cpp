@@ -61,7 +61,9 @@ void LoreComponent::onStorageTransaction(db::Transaction &t) {
 }
 
 void LoreComponent::onHeartbeat(Server &serv) {
-
+	if (auto wiki = serv.getComponent<WikiComponent>()) {
+		wiki->performSpineUpdates();
+	}
 }
 
 SP_EXTERN_C ServerComponent * CreateLore(Server &serv, const String &name, const data::Value &dict) {
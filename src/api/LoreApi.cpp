@@ -29,8 +29,22 @@ THE SOFTWARE.
 
 NS_SA_EXT_BEGIN(lore)
 
+ApiCall::AuthCache *ApiCall::AuthCache::get(const Request &req) {
+	auto pool = req.pool();
+	if (auto ret = mem::pool::get<AuthCache>(pool, "Lore.ApiCall.AuthCache")) {
+		return ret;
+	}
+
+	mem::pool::push(pool);
+	auto ret = new (pool) AuthCache();
+	mem::pool::store(pool, ret, "Lore.ApiCall.AuthCache");
+	mem::pool::pop();
+	return ret;
+}
+
 ApiCall::ApiCall(const Request &req)
-: _request(req)
+: _auth(AuthCache::get(req))
+, _request(req)
 , _server(req.server())
 , _transaction(db::Transaction::acquire(req.storage()))
 , _users(_server.getComponent<UsersComponent>())
@@ -40,7 +54,8 @@ ApiCall::ApiCall(const Request &req)
 }
 
 ApiCall::ApiCall(Server serv, const db::Transaction &t)
-: _server(serv)
+: _auth(&_localAuth)
+, _server(serv)
 , _transaction(t)
 , _users(_server.getComponent<UsersComponent>())
 , _wiki(_server.getComponent<WikiComponent>())
@@ -67,7 +82,7 @@ ApiCall::~ApiCall() {
 }
 
 data::Value ApiCall::createProject(int64_t user, StringView name, StringView title) const {
-	if (auto u = getUser(user)) {
+	if (hasUser(user)) {
 		auto r = _wiki->getProjects().select(_transaction, db::Query().select("name", data::Value(name)));
 		if (!r.empty()) {
 			onError(__func__, NON_UNIQUE);
@@ -85,6 +100,16 @@ data::Value ApiCall::createProject(int64_t user, StringView name, StringView tit
 				pair("project", data::Value(ret.getInteger("__oid"))),
 				pair("role", data::Value(toInt(WikiRole::Admin)))
 			}))) {
+				// cached user has previous grants version
+				_wiki->bumpGrantsVersion(_transaction, user);
+				_auth->users.erase(user);
+
+				auto it = _auth->grants.find(user);
+				if (it != _auth->grants.end()) {
+					it->second.emplace(ret.getInteger("__oid"), toInt(WikiRole::Admin));
+					writeGrantsSnapshot(user, it->second);
+				}
+
 				ret.setValue(data::Value({
 					data::Value(move(g))
 				}), "grants");
@@ -101,33 +126,65 @@ data::Value ApiCall::createProject(int64_t user, StringView name, StringView tit
 }
 
 data::Value ApiCall::getAvailableProjects(int64_t user) {
-	if (auto u = getUser(user)) {
-		auto g = _wiki->getGrants().select(_transaction, db::Query().select("user", data::Value(user)));
+	// result is memoized within request, index page requests it for content and navigation
+	auto key = toString("Lore.AvailableProjects.", user);
+	if (_request) {
+		if (auto cached = mem::pool::get<data::Value>(_request.pool(), key)) {
+			return *cached;
+		}
+	}
+
+	data::Value ret;
+	if (hasUser(user)) {
+		// projects are fetched with grants, in single batched select
+		auto g = _wiki->getGrants().select(_transaction, db::Query()
+				.select("user", data::Value(user))
+				.include("role")
+				.include(db::Query::Field("project", {"title", "name", "defaultLanguage"})));
 		if (g) {
-			for (auto &it : g.asArray()) {
-				if (auto proj = _wiki->getProjects().get(_transaction, it.getInteger("project"))) {
-					it.setValue(proj, "project");
-				} else {
+			auto &arr = g.asArray();
+			auto it = arr.begin();
+			while (it != arr.end()) {
+				if (!it->isDictionary("project")) {
 					onError(__func__, PROJECT_NOT_FOUND);
+					it = arr.erase(it);
+				} else {
+					++ it;
 				}
 			}
-			return g;
+			ret = move(g);
 		}
 	}
-	return data::Value();
+
+	if (_request) {
+		auto pool = _request.pool();
+		mem::pool::push(pool);
+		mem::pool::store(pool, new (pool) data::Value(ret), key);
+		mem::pool::pop();
+	}
+	return ret;
+}
+
+static data::Value ApiCall_getProject(const Scheme &scheme, const db::Transaction &t, int64_t id, ApiCall::ProjectFields fields) {
+	switch (fields) {
+	case ApiCall::ProjectFields::Header: return scheme.get(t, id, {"name", "title", "defaultLanguage"});
+	case ApiCall::ProjectFields::Template: return scheme.get(t, id, {"name", "title", "defaultLanguage", "tags", "cover"});
+	case ApiCall::ProjectFields::Full: break;
+	}
+	return scheme.get(t, id);
 }
 
-data::Value ApiCall::getProject(int64_t user, int64_t proj) {
-	if (auto u = getUser(user)) {
-		auto g = _wiki->getGrants().select(_transaction, db::Query().select("user", data::Value(user)).select("project", data::Value(proj)));
-		if (g.size() == 1) {
-			auto role = g.getValue(0).getInteger("role");
-			if (role <= toInt(WikiRole::Nobody)) {
+data::Value ApiCall::getProject(int64_t user, int64_t proj, ProjectFields fields) {
+	if (hasUser(user)) {
+		auto &g = getGrants(user);
+		auto it = g.find(proj);
+		if (it != g.end()) {
+			if (it->second <= toInt(WikiRole::Nobody)) {
 				onError(__func__, GRANT_FAILED);
 				return data::Value();
 			}
 
-			if (auto proj = _wiki->getProjects().get(_transaction, g.getValue(0).getInteger("project"))) {
+			if (auto proj = ApiCall_getProject(_wiki->getProjects(), _transaction, it->first, fields)) {
 				return proj;
 			} else {
 				onError(__func__, PROJECT_NOT_FOUND);
@@ -139,21 +196,596 @@ data::Value ApiCall::getProject(int64_t user, int64_t proj) {
 	return data::Value();
 }
 
-data::Value ApiCall::getUser(int64_t user) const {
-	if (auto ret = _users->getExternalUserScheme().get(_transaction, user)) {
+static data::Value ApiCall_copyFields(const data::Value &source, std::initializer_list<StringView> fields) {
+	data::Value ret;
+	for (auto &it : fields) {
+		if (source.hasValue(it)) {
+			ret.setValue(source.getValue(it), it);
+		}
+	}
+	return ret;
+}
+
+static data::Value ApiCall_remapOrder(const data::Value &order, const Map<int64_t, Pair<const Scheme *, int64_t>> &ids) {
+	data::Value ret;
+	for (auto &it : order.asArray()) {
+		auto id = ids.find(it.getInteger());
+		if (id != ids.end()) {
+			ret.addInteger(id->second.second);
+		}
+	}
+	return ret;
+}
+
+enum class ApiCall_ImportStatus {
+	Created,
+	Failed,
+	Deferred, // object, it refers to, is not imported yet
+};
+
+static bool ApiCall_isValidRecordId(const data::Value &record) {
+	return record.isInteger("id") && record.getInteger("id") > 0;
+}
+
+data::Value ApiCall::importProject(int64_t user, const Callback<bool(data::Value &)> &read) const {
+	data::Value source;
+	if (!read(source) || source.getString("type") != "project" || !ApiCall_isValidRecordId(source)) {
+		onError(__func__, INVALID_INPUT);
+		return data::Value();
+	}
+
+	auto proj = createProject(user, source.getString("name"), source.getString("title"));
+	if (!proj) {
+		return data::Value();
+	}
+
+	auto projectId = proj.getInteger("__oid");
+
+	// source id -> scheme and id of created object
+	Map<int64_t, Pair<const Scheme *, int64_t>> ids;
+	ids.emplace(source.getInteger("id"), pair(&_wiki->getProjects(), projectId));
+
+	// source ids of all read records, created or not, so repeated id is rejected on first repeat
+	Set<int64_t> seen;
+	seen.emplace(source.getInteger("id"));
+
+	size_t created = 0;
+	size_t failed = 0;
+	size_t invalid = 0;
+
+	// only records, that can not be imported yet, and orderings are kept until the end of input
+	Vector<data::Value> deferred;
+	Vector<Pair<int64_t, data::Value>> ordered;
+
+	auto importSection = [&] (const data::Value &it) -> ApiCall_ImportStatus {
+		auto root = it.getInteger("root");
+		if (root && ids.find(root) == ids.end()) {
+			return ApiCall_ImportStatus::Deferred;
+		}
+
+		auto obj = ApiCall_copyFields(it, {"name", "title", "tags", "hidden"});
+		obj.setInteger(projectId, "project");
+		if (root) {
+			obj.setInteger(ids.at(root).second, "root");
+		}
+
+		if (auto ret = _wiki->getSections().create(_transaction, obj)) {
+			ids.emplace(it.getInteger("id"), pair(&_wiki->getSections(), ret.getInteger("__oid")));
+			if (it.isArray("order")) {
+				ordered.emplace_back(it.getInteger("id"), it.getValue("order"));
+			}
+			return ApiCall_ImportStatus::Created;
+		}
+		return ApiCall_ImportStatus::Failed;
+	};
+
+	auto importPage = [&] (const data::Value &it) -> ApiCall_ImportStatus {
+		auto section = ids.find(it.getInteger("section"));
+		if (section == ids.end()) {
+			return ApiCall_ImportStatus::Deferred;
+		}
+
+		auto obj = ApiCall_copyFields(it, {"name", "title", "tags", "hidden"});
+		obj.setInteger(projectId, "project");
+		obj.setInteger(section->second.second, "section");
+		if (auto ret = _wiki->getPages().create(_transaction, obj)) {
+			ids.emplace(it.getInteger("id"), pair(&_wiki->getPages(), ret.getInteger("__oid")));
+			return ApiCall_ImportStatus::Created;
+		}
+		return ApiCall_ImportStatus::Failed;
+	};
+
+	auto importLocale = [&] (const data::Value &it) -> ApiCall_ImportStatus {
+		auto origin = ids.find(it.getInteger("origin"));
+		if (origin == ids.end()) {
+			return ApiCall_ImportStatus::Deferred;
+		}
+
+		auto obj = ApiCall_copyFields(it, {"language", "title", "tags"});
+		obj.setInteger(projectId, "project");
+		obj.setInteger(origin->second.second, "origin");
+
+		// markdown is stored as is, meta and html are generated by reprocessing after import
+		auto &type = it.getString("contentType");
+		obj.setValue(data::Value({
+			pair("type", data::Value((type.empty() || type == WikiComponent::ContentTypeMarkdown)
+					? WikiComponent::ContentTypeMarkdownForced : StringView(type))),
+			pair("content", data::Value(it.getString("content"))),
+		}), "content");
+
+		if (auto ret = _wiki->getLocale().create(_transaction, obj)) {
+			if (origin->second.first->appendProperty(_transaction, origin->second.second, "locale",
+					data::Value(ret.getInteger("__oid")))) {
+				return ApiCall_ImportStatus::Created;
+			}
+		}
+		return ApiCall_ImportStatus::Failed;
+	};
+
+	auto importRecord = [&] (data::Value &it) -> ApiCall_ImportStatus {
+		auto &type = it.getString("type");
+		if (type == "section") {
+			return importSection(it);
+		} else if (type == "page") {
+			return importPage(it);
+		} else if (type == "locale") {
+			return importLocale(it);
+		}
+		return ApiCall_ImportStatus::Failed;
+	};
+
+	auto importBatch = [&] (Vector<data::Value> &batch, Vector<data::Value> &next) {
+		_transaction.perform([&] {
+			for (auto &it : batch) {
+				switch (importRecord(it)) {
+				case ApiCall_ImportStatus::Created: ++ created; break;
+				case ApiCall_ImportStatus::Failed: ++ failed; break;
+				case ApiCall_ImportStatus::Deferred: next.emplace_back(move(it)); break;
+				}
+			}
+			return true;
+		});
+		batch.clear();
+	};
+
+	// records are read and committed by batches, input is never loaded as a whole
+	Vector<data::Value> batch;
+	batch.reserve(ImportBatchSize);
+
+	data::Value record;
+	while (read(record)) {
+		// sections and pages are referred by source ids, so record without valid and unique id can not be imported
+		if (!ApiCall_isValidRecordId(record) || (record.getString("type") != "locale" && !seen.emplace(record.getInteger("id")).second)) {
+			++ invalid;
+		} else {
+			batch.emplace_back(move(record));
+			if (batch.size() >= ImportBatchSize) {
+				importBatch(batch, deferred);
+			}
+		}
+		record = data::Value();
+	}
+
+	if (!batch.empty()) {
+		importBatch(batch, deferred);
+	}
+
+	// object can refer to one, that comes later in input; deferred ones are retried, while any of them is imported
+	while (!deferred.empty()) {
+		auto count = deferred.size();
+		Vector<data::Value> next;
+		for (size_t i = 0; i < deferred.size(); i += ImportBatchSize) {
+			auto end = std::min(i + ImportBatchSize, deferred.size());
+			for (size_t j = i; j < end; ++ j) {
+				batch.emplace_back(move(deferred[j]));
+			}
+			importBatch(batch, next);
+		}
+
+		deferred = move(next);
+		if (deferred.size() == count) {
+			failed += deferred.size();
+			break;
+		}
+	}
+
+	if (invalid) {
+		onError(__func__, INVALID_INPUT);
+	}
+
+	// ordering refers to sections and pages, so it can be restored only after all of them were created
+	if (source.isArray("order")) {
+		ordered.emplace_back(source.getInteger("id"), source.getValue("order"));
+	}
+
+	for (size_t i = 0; i < ordered.size(); i += ImportBatchSize) {
+		auto end = std::min(i + ImportBatchSize, ordered.size());
+		_transaction.perform([&] {
+			for (size_t j = i; j < end; ++ j) {
+				auto &target = ids.at(ordered[j].first);
+				storage::Worker(*target.first, _transaction).update(target.second, data::Value({
+					pair("order", ApiCall_remapOrder(ordered[j].second, ids))
+				}));
+			}
+			return true;
+		});
+	}
+
+	if (source.hasValue("defaultLanguage") || source.hasValue("tags")) {
+		storage::Worker(_wiki->getProjects(), _transaction).update(projectId, ApiCall_copyFields(source, {"defaultLanguage", "tags"}));
+	}
+
+	// one pass for markdown meta in server tasks, one spine rebuild, when writes settle down
+	auto reprocess = _wiki->reprocessProject(projectId);
+	_wiki->scheduleSpineUpdate(projectId);
+
+	proj.setValue(data::Value({
+		pair("created", data::Value(int64_t(created))),
+		pair("failed", data::Value(int64_t(failed))),
+		pair("invalid", data::Value(int64_t(invalid))),
+		pair("reprocess", move(reprocess)),
+	}), "import");
+	return proj;
+}
+
+static void ApiCall_writeRecord(std::ostream &stream, const data::Value &val) {
+	auto bytes = data::write(val, data::EncodeFormat::Json);
+	stream.write((const char *)bytes.data(), bytes.size());
+	stream << "\n";
+}
+
+bool ApiCall::exportProject(int64_t user, int64_t project, std::ostream &stream) const {
+	if (!isProjectAllowed(user, project)) {
+		return false;
+	}
+
+	// locale is selected with its owners, so every locale record follows the object it belongs to
+	auto localeField = db::Query::Field("locale", {"language", "title", "tags", "content"});
+
+	auto writeLocale = [&] (const data::Value &owner) {
+		auto &locale = owner.getValue("locale");
+		if (!locale.isArray()) {
+			return;
+		}
+
+		for (auto &it : locale.asArray()) {
+			auto record = ApiCall_copyFields(it, {"language", "title", "tags"});
+			record.setString("locale", "type");
+			record.setInteger(it.getInteger("__oid"), "id");
+			record.setInteger(owner.getInteger("__oid"), "origin");
+
+			auto &content = it.getValue("content");
+			record.setString(content.getString("type"), "contentType");
+			record.setString(content.getString("content"), "content");
+			ApiCall_writeRecord(stream, record);
+		}
+	};
+
+	auto proj = _wiki->getProjects().select(_transaction, db::Query().select(project)
+			.include("name").include("title").include("tags").include("defaultLanguage").include("order")
+			.include(db::Query::Field(localeField))).getValue(0);
+	if (!proj) {
+		onError(__func__, PROJECT_NOT_FOUND);
+		return false;
+	}
+
+	auto record = ApiCall_copyFields(proj, {"name", "title", "tags", "defaultLanguage", "order"});
+	record.setString("project", "type");
+	record.setInteger(project, "id");
+	ApiCall_writeRecord(stream, record);
+	writeLocale(proj);
+	stream.flush();
+
+	// objects are selected by id ranges, so output starts without waiting for whole project
+	auto exportScheme = [&] (const Scheme &scheme, StringView type, std::initializer_list<StringView> fields) {
+		int64_t next = 0;
+		while (true) {
+			auto q = db::Query()
+					.select("project", data::Value(project))
+					.select("__oid", db::Comparation::GreatherOrEqual, data::Value(next))
+					.order("__oid")
+					.limit(ExportBatchSize);
+			for (auto &it : fields) {
+				q.include(it);
+			}
+			q.include(db::Query::Field(localeField));
+
+			auto objs = scheme.select(_transaction, q);
+			if (!objs.isArray() || objs.empty()) {
+				break;
+			}
+
+			for (auto &it : objs.asArray()) {
+				auto record = ApiCall_copyFields(it, fields);
+				record.setString(type, "type");
+				record.setInteger(it.getInteger("__oid"), "id");
+				ApiCall_writeRecord(stream, record);
+				writeLocale(it);
+				next = it.getInteger("__oid") + 1;
+			}
+			stream.flush();
+
+			if (objs.size() < ExportBatchSize) {
+				break;
+			}
+		}
+	};
+
+	exportScheme(_wiki->getSections(), "section", {"name", "title", "tags", "hidden", "order", "root"});
+	exportScheme(_wiki->getPages(), "page", {"name", "title", "tags", "hidden", "section"});
+
+	return true;
+}
+
+data::Value ApiCall::searchPages(int64_t user, int64_t project, StringView text, size_t limit, size_t snippets) const {
+	if (!isProjectAllowed(user, project)) {
+		return data::Value();
+	}
+
+	auto locale = _wiki->getLocale().select(_transaction, db::Query()
+			.select("project", data::Value(project))
+			.select("ts", db::Comparation::Includes, data::Value(text))
+			.order("ts", db::Ordering::Descending)
+			.limit(limit)
+			.include("title").include("language").include("origin"));
+
+	if (!locale.isArray() || locale.empty()) {
+		return data::Value();
+	}
+
+	// locale of sections and project itself are not pages, owners are selected by single query
+	data::Value origins;
+	for (auto &it : locale.asArray()) {
+		origins.addInteger(it.getInteger("origin"));
+	}
+
+	Map<int64_t, data::Value> pages;
+	auto pagesData = _wiki->getPages().select(_transaction, db::Query()
+			.select("__oid", db::Comparation::In, move(origins))
+			.include("name").include("title").include("section").include("project"));
+	for (auto &it : pagesData.asArray()) {
+		if (it.getInteger("project") == project) {
+			pages.emplace(it.getInteger("__oid"), move(it));
+		}
+	}
+
+	data::Value ret;
+	data::Value top;
+	for (auto &it : locale.asArray()) {
+		auto page = pages.find(it.getInteger("origin"));
+		if (page != pages.end()) {
+			if (ret.size() < snippets) {
+				top.addInteger(it.getInteger("__oid"));
+			}
+			ret.addValue(data::Value({
+				pair("page", data::Value(page->second)),
+				pair("locale", move(it)),
+			}));
+		}
+	}
+
+	if (top.empty()) {
+		return ret;
+	}
+
+	// snippets are generated only for top hits, within common time budget
+	auto deadline = Time::now() + TimeInterval::microseconds(SearchSnippetsBudget);
+	auto content = _wiki->getLocale().select(_transaction, db::Query()
+			.select("__oid", db::Comparation::In, move(top))
+			.include("content"));
+
+	Map<int64_t, const data::Value *> contentIndex;
+	for (auto &it : content.asArray()) {
+		contentIndex.emplace(it.getInteger("__oid"), &it.getValue("content"));
+	}
+
+	for (auto &it : ret.asArray()) {
+		auto c = contentIndex.find(it.getValue("locale").getInteger("__oid"));
+		if (c == contentIndex.end()) {
+			continue;
+		}
+
+		auto now = Time::now();
+		if (now >= deadline) {
+			break;
+		}
+
+		auto &obj = *c->second;
+		if (obj.getString("type") == WikiComponent::ContentTypeMarkdown) {
+			if (auto s = makeSearchSnippets(mem::pool::acquire(), obj.getString("content"), obj.getValue("meta"), text,
+					SearchSnippetsCount, deadline - now)) {
+				it.setValue(move(s), "snippets");
+			}
+		}
+	}
+	return ret;
+}
+
+static data::Value ApiCall_encodeSpineNode(const UnitSpineIndex::Node &node) {
+	data::Value ret({
+		pair("id", data::Value(node.id)),
+		pair("title", data::Value(node.data.getString("title"))),
+		pair("name", data::Value(node.data.getString("name"))),
+	});
+	switch (node.type) {
+	case UnitSpineIndex::Type::Unit: ret.setString("unit", "type"); break;
+	case UnitSpineIndex::Type::Section: ret.setString("section", "type"); break;
+	case UnitSpineIndex::Type::Page: ret.setString("page", "type"); break;
+	}
+	return ret;
+}
+
+static void ApiCall_writeSpineToc(const UnitSpineIndex &spine, const UnitSpineIndex::Node &node, data::Value &target, size_t depth) {
+	auto &childs = node.nodes.empty() ? node.unordered : node.nodes;
+	if (depth == 0 || childs.empty()) {
+		return;
+	}
+
+	auto &arr = target.emplace("childs");
+	for (auto &it : childs) {
+		if (auto n = spine.getNode(it)) {
+			if (!n->excluded) {
+				auto &v = arr.addValue(ApiCall_encodeSpineNode(*n));
+				ApiCall_writeSpineToc(spine, *n, v, depth - 1);
+			}
+		}
+	}
+}
+
+data::Value ApiCall::getSpineToc(int64_t user, int64_t project, int64_t node, size_t depth) const {
+	if (!isProjectAllowed(user, project)) {
+		return data::Value();
+	}
+
+	auto spine = UnitSpineIndex::get(_transaction, project);
+	auto n = spine.getNode(node ? node : project);
+	if (!n) {
+		onError(__func__, NODE_NOT_FOUND);
+		return data::Value();
+	}
+
+	auto ret = ApiCall_encodeSpineNode(*n);
+	ApiCall_writeSpineToc(spine, *n, ret, std::min(depth, SpineTocMaxDepth));
+	if (spine.stale) {
+		ret.setBool(true, "stale");
+	}
+	return ret;
+}
+
+data::Value ApiCall::getSpineNavigation(int64_t user, int64_t project, int64_t node) const {
+	if (!isProjectAllowed(user, project)) {
+		return data::Value();
+	}
+
+	auto spine = UnitSpineIndex::get(_transaction, project);
+	auto n = spine.getNode(node);
+	if (!n) {
+		onError(__func__, NODE_NOT_FOUND);
+		return data::Value();
+	}
+
+	data::Value ret;
+	ret.setValue(ApiCall_encodeSpineNode(*n), "node");
+
+	if (auto prev = n->prev ? spine.getNode(n->prev) : nullptr) {
+		ret.setValue(ApiCall_encodeSpineNode(*prev), "prev");
+	}
+	if (auto next = n->next ? spine.getNode(n->next) : nullptr) {
+		ret.setValue(ApiCall_encodeSpineNode(*next), "next");
+	}
+
+	// from unit to node's parent, bounded by spine size to be safe with cycles
+	Vector<const UnitSpineIndex::Node *> path;
+	auto p = n->parent ? spine.getNode(n->parent) : nullptr;
+	while (p && path.size() < spine.size()) {
+		path.emplace_back(p);
+		p = p->parent ? spine.getNode(p->parent) : nullptr;
+	}
+
+	// top-level sections are stored without parent, so chain, that ends before unit, is completed with it
+	auto top = path.empty() ? n : path.back();
+	if (top->id != spine.unit) {
+		if (auto unit = spine.getNode(spine.unit)) {
+			path.emplace_back(unit);
+		}
+	}
+
+	auto &breadcrumbs = ret.emplace("breadcrumbs");
+	for (auto it = path.rbegin(); it != path.rend(); ++ it) {
+		breadcrumbs.addValue(ApiCall_encodeSpineNode(**it));
+	}
+
+	if (spine.stale) {
+		ret.setBool(true, "stale");
+	}
+	return ret;
+}
+
+data::Value ApiCall::getSpineTags(int64_t user, int64_t project, StringView tag) const {
+	if (!isProjectAllowed(user, project)) {
+		return data::Value();
+	}
+
+	auto spine = UnitSpineIndex::get(_transaction, project);
+
+	data::Value ret;
+	if (tag.empty()) {
+		auto &tags = ret.emplace("tags");
+		for (auto &it : spine.tags) {
+			tags.addValue(data::Value({
+				pair("tag", data::Value(it.first)),
+				pair("count", data::Value(int64_t(it.second))),
+			}));
+		}
+	} else {
+		ret.setString(tag, "tag");
+		auto &pages = ret.emplace("pages");
+		for (auto &it : spine.getTagPages(tag)) {
+			if (auto n = spine.getNode(it)) {
+				pages.addValue(ApiCall_encodeSpineNode(*n));
+			}
+		}
+	}
+
+	if (spine.stale) {
+		ret.setBool(true, "stale");
+	}
+	return ret;
+}
+
+static data::Value ApiCall_getUser(const Scheme &scheme, const db::Transaction &t, int64_t id, ApiCall::UserFields fields) {
+	switch (fields) {
+	case ApiCall::UserFields::Id: return scheme.get(t, id, {"grantsVersion"});
+	case ApiCall::UserFields::Role: return scheme.get(t, id, {"role", "grantsVersion"});
+	case ApiCall::UserFields::Template: return scheme.get(t, id, {"fullName", "email", "picture", "role", "grantsVersion"});
+	case ApiCall::UserFields::Full: break;
+	}
+	return scheme.get(t, id);
+}
+
+data::Value ApiCall::getUser(int64_t user, UserFields fields) const {
+	// cached user can be used, if it was loaded with wider set of fields, or was not found at all
+	auto it = _auth->users.find(user);
+	if (it != _auth->users.end() && (!it->second.second || toInt(it->second.first) >= toInt(fields))) {
+		if (it->second.second) {
+			return it->second.second;
+		}
+	} else if (auto ret = ApiCall_getUser(_users->getExternalUserScheme(), _transaction, user, fields)) {
+		_auth->users[user] = pair(fields, ret);
 		return ret;
+	} else {
+		_auth->users[user] = pair(fields, data::Value());
 	}
+
 	onError(__func__, INVALID_USER);
 	return data::Value();
 }
 
+const Map<int64_t, int64_t> &ApiCall::getGrants(int64_t user) const {
+	auto it = _auth->grants.find(user);
+	if (it != _auth->grants.end()) {
+		return it->second;
+	}
+
+	Map<int64_t, int64_t> roles;
+	if (readGrantsSnapshot(user, roles)) {
+		return _auth->grants.emplace(user, move(roles)).first->second;
+	}
+
+	auto g = _wiki->getGrants().select(_transaction, db::Query().select("user", data::Value(user)).include("project").include("role"));
+	for (auto &it : g.asArray()) {
+		roles.emplace(it.getInteger("project"), it.getInteger("role"));
+	}
+
+	writeGrantsSnapshot(user, roles);
+	return _auth->grants.emplace(user, move(roles)).first->second;
+}
+
 bool ApiCall::isProjectAllowed(int64_t user, int64_t project) const {
-	auto ret = _wiki->getGrants().select(_transaction, db::Query().select("user", data::Value(user)).select("project", data::Value(project)));
-	if (ret.size() == 1) {
-		auto role = ret.getValue(0).getInteger("role");
-		if (role > toInt(WikiRole::Nobody)) {
-			return true;
-		}
+	auto &g = getGrants(user);
+	auto it = g.find(project);
+	if (it != g.end() && it->second > toInt(WikiRole::Nobody)) {
+		return true;
 	}
 
 	onError(__func__, GRANT_FAILED);
@@ -164,4 +796,62 @@ void ApiCall::onError(StringView fn, StringView err) const {
 	_errors.emplace_back(fn, err);
 }
 
+ExternalSession *ApiCall::getUserSession(int64_t user) const {
+	if (_request) {
+		if (auto s = ExternalSession::get(_request)) {
+			if (int64_t(s->getUser()) == user) {
+				return s;
+			}
+		}
+	}
+	return nullptr;
+}
+
+bool ApiCall::readGrantsSnapshot(int64_t user, Map<int64_t, int64_t> &roles) const {
+	auto s = getUserSession(user);
+	if (!s) {
+		return false;
+	}
+
+	auto &snapshot = s->getValue("grants");
+	if (!snapshot.isDictionary() || !snapshot.isDictionary("roles")) {
+		return false;
+	}
+
+	// user row is already resolved for most of calls, so version check costs nothing in common case
+	auto u = getUser(user, UserFields::Id);
+	if (!u || snapshot.getInteger("version") != u.getInteger("grantsVersion")
+			|| int64_t(Time::now().toMicros()) - snapshot.getInteger("time") > int64_t(GrantsSnapshotMaxAge)) {
+		return false;
+	}
+
+	for (auto &it : snapshot.getDict("roles")) {
+		if (auto id = StringView(it.first).readInteger().get(0)) {
+			roles.emplace(id, it.second.getInteger());
+		}
+	}
+	return true;
+}
+
+void ApiCall::writeGrantsSnapshot(int64_t user, const Map<int64_t, int64_t> &roles) const {
+	auto s = getUserSession(user);
+	if (!s) {
+		return;
+	}
+
+	auto u = getUser(user, UserFields::Id);
+	if (!u) {
+		return;
+	}
+
+	data::Value snapshot;
+	snapshot.setInteger(u.getInteger("grantsVersion"), "version");
+	snapshot.setInteger(int64_t(Time::now().toMicros()), "time");
+	auto &r = snapshot.emplace("roles");
+	for (auto &it : roles) {
+		r.setInteger(it.second, toString(it.first));
+	}
+	s->setValue(move(snapshot), "grants");
+}
+
 NS_SA_EXT_END(lore)
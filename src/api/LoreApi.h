@@ -29,11 +29,41 @@ NS_SA_EXT_BEGIN(lore)
 
 class ApiCall {
 public:
+	// fields to load for user, every next set includes previous one
+	enum class UserFields {
+		Id, // existence and grants version
+		Role,
+		Template, // fields, used by page templates
+		Full,
+	};
+
+	// fields to load for project
+	enum class ProjectFields {
+		Header, // name, title and default language
+		Template,
+		Full,
+	};
+
+	// resolved users and their grants, shared by all ApiCall instances within request
+	struct AuthCache {
+		Map<int64_t, Pair<UserFields, data::Value>> users;
+		Map<int64_t, Map<int64_t, int64_t>> grants; // user -> project -> role
+
+		static AuthCache *get(const Request &);
+	};
+
 	static constexpr StringView INVALID_USER = "INVALID_USER";
 	static constexpr StringView GRANT_FAILED = "GRANT_FAILED";
 	static constexpr StringView CREATE_FAILED = "CREATE_FAILED";
 	static constexpr StringView NON_UNIQUE = "NON_UNIQUE";
 	static constexpr StringView PROJECT_NOT_FOUND = "PROJECT_NOT_FOUND";
+	static constexpr StringView NODE_NOT_FOUND = "NODE_NOT_FOUND";
+	static constexpr StringView INVALID_INPUT = "INVALID_INPUT";
+
+	static constexpr size_t SpineTocMaxDepth = 8;
+
+	// session grants snapshot is trusted while user grantsVersion is the same, but no longer than this
+	static constexpr uint64_t GrantsSnapshotMaxAge = 300'000'000; // microseconds
 
 	ApiCall(const Request &);
 	ApiCall(Server, const db::Transaction &);
@@ -42,16 +72,52 @@ public:
 
 	data::Value createProject(int64_t user, StringView name, StringView title) const;
 	data::Value getAvailableProjects(int64_t user);
-	data::Value getProject(int64_t user, int64_t proj);
+	data::Value getProject(int64_t user, int64_t proj, ProjectFields = ProjectFields::Full);
+
+	static constexpr size_t ImportBatchSize = 256; // records per transaction
+	static constexpr size_t ImportMaxSize = 256_MiB; // request body, stored in temporary file
+	static constexpr size_t ExportBatchSize = 256; // objects per select
+
+	// creates project from project, section, page and locale records, project record should be the first one;
+	// records are pulled from reader and committed in batches, markdown meta and spine are built once, after all records are stored
+	data::Value importProject(int64_t user, const Callback<bool(data::Value &)> &read) const;
+
+	// writes project in the same records, one JSON object per line, as importProject reads them
+	bool exportProject(int64_t user, int64_t project, std::ostream &) const;
+
+	static constexpr size_t SearchSnippetsPages = 5;
+	static constexpr uint64_t SearchSnippetsBudget = 50'000; // in microseconds, for all snippets of result page
 
-	data::Value getUser(int64_t) const;
+	// full-text search over project locale, returns pages ordered by rank, top hits with highlighted snippets
+	data::Value searchPages(int64_t user, int64_t project, StringView text, size_t limit = 20,
+			size_t snippets = SearchSnippetsPages) const;
+
+	// spine navigation, served from stored spine without section and page selects
+	data::Value getSpineToc(int64_t user, int64_t project, int64_t node, size_t depth = 2) const;
+	data::Value getSpineNavigation(int64_t user, int64_t project, int64_t node) const;
+
+	// list of project tags, or pages for tag, if it's not empty
+	data::Value getSpineTags(int64_t user, int64_t project, StringView tag) const;
+
+	data::Value getUser(int64_t, UserFields = UserFields::Full) const;
+	bool hasUser(int64_t user) const { return getUser(user, UserFields::Id) ? true : false; }
 	bool isProjectAllowed(int64_t user, int64_t project) const;
 
+	// project -> role for all user grants, served from session snapshot when it's up to date
+	const Map<int64_t, int64_t> &getGrants(int64_t user) const;
+
 	const Vector<Pair<StringView, StringView>> & getError() const { return _errors; }
 
 protected:
 	void onError(StringView, StringView) const;
 
+	ExternalSession *getUserSession(int64_t user) const;
+	bool readGrantsSnapshot(int64_t user, Map<int64_t, int64_t> &) const;
+	void writeGrantsSnapshot(int64_t user, const Map<int64_t, int64_t> &) const;
+
+	AuthCache _localAuth; // for calls without request
+	AuthCache *_auth = nullptr;
+
 	Request _request;
 	Server _server;
 	db::Transaction _transaction = nullptr;
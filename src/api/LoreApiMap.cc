@@ -26,6 +26,72 @@ THE SOFTWARE.
 
 NS_SA_EXT_BEGIN(lore)
 
+// project records are streamed as they are selected, response is never built in memory as a whole
+class ExportProjectHandler : public HandlerMap::Handler {
+public:
+	virtual bool isPermitted() override {
+		if (auto e = ExternalSession::get(_request)) {
+			auto &query = getQueryFields();
+			_user = e->getUser();
+			_project = query.isInteger("project") ? query.getInteger("project") : e->getInteger("project");
+			return _user && _project;
+		}
+		return false;
+	}
+
+	virtual int onRequest() override {
+		ApiCall call(_request);
+		if (!call.isProjectAllowed(_user, _project)) {
+			return HTTP_FORBIDDEN;
+		}
+
+		_request.setContentType("application/x-ndjson");
+		call.exportProject(_user, _project, _request);
+		return DONE;
+	}
+
+protected:
+	int64_t _user = 0;
+	int64_t _project = 0;
+};
+
+// request body is stored by input filter in temporary file, records are read from it one line at a time
+class ImportProjectHandler : public HandlerMap::Handler {
+public:
+	virtual bool isPermitted() override {
+		if (auto e = ExternalSession::get(_request)) {
+			_user = e->getUser();
+			return _user != 0;
+		}
+		return false;
+	}
+
+	virtual data::Value onData() override {
+		auto filter = _request.getInputFilter();
+		auto file = filter ? filter->getInputFile(0) : nullptr;
+		if (!file) {
+			return data::Value();
+		}
+
+		std::ifstream stream(file->path.data());
+		std::string line;
+		return ApiCall(_request).importProject(_user, [&] (data::Value &record) -> bool {
+			while (std::getline(stream, line)) {
+				StringView r(line);
+				r.trimChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+				if (!r.empty()) {
+					record = data::read(r);
+					return true;
+				}
+			}
+			return false;
+		});
+	}
+
+protected:
+	int64_t _user = 0;
+};
+
 ApiHandlerMap::ApiHandlerMap() {
 	using namespace db;
 
@@ -48,6 +114,18 @@ ApiHandlerMap::ApiHandlerMap() {
 		Field::Text("title", MinLength(2), MaxLength(1_KiB), Flags::Required),
 	});
 
+	db::InputConfig importConfig;
+	importConfig.required = db::InputConfig::Require::Files;
+	importConfig.maxRequestSize = ApiCall::ImportMaxSize;
+	importConfig.maxFileSize = ApiCall::ImportMaxSize;
+
+	addHandler("ImportProject", Request::Method::Post, "/importProject", SA_HANDLER(ImportProjectHandler))
+		.setInputConfig(importConfig);
+
+	addHandler("ExportProject", Request::Method::Get, "/exportProject", SA_HANDLER(ExportProjectHandler)).addQueryFields({
+		Field::Integer("project"),
+	});
+
 	addHandler("SelectProject", Request::Method::Get, "/selectProject", accessControlFn,
 			[] (HandlerMap::Handler &h) -> data::Value {
 		auto id = h.getQueryFields().getInteger("id");
@@ -67,10 +145,66 @@ ApiHandlerMap::ApiHandlerMap() {
 	addHandler("GetSelectedProject", Request::Method::Get, "/getSelectedProject", accessControlFn,
 			[] (HandlerMap::Handler &h) -> data::Value {
 		if (auto e = ExternalSession::get(h.getRequest())) {
-			return ApiCall(h.getRequest()).getProject(e->getUser(), e->getInteger("projects"));
+			return ApiCall(h.getRequest()).getProject(e->getUser(), e->getInteger("project"));
 		}
 		return data::Value();
 	}, data::Value({ pair("location", data::Value("target")) }));
+
+	addHandler("SearchPages", Request::Method::Get, "/searchPages", accessControlFn,
+			[] (HandlerMap::Handler &h) -> data::Value {
+		auto &query = h.getQueryFields();
+		if (auto e = ExternalSession::get(h.getRequest())) {
+			auto project = query.isInteger("project") ? query.getInteger("project") : e->getInteger("project");
+			return ApiCall(h.getRequest()).searchPages(e->getUser(), project, query.getString("text"),
+					size_t(std::min(std::max(query.getInteger("limit", 20), int64_t(1)), int64_t(100))));
+		}
+		return data::Value();
+	}, data::Value({ pair("location", data::Value("target")) })).addQueryFields({
+		Field::Text("text", MinLength(2), MaxLength(256), Flags::Required),
+		Field::Integer("project"),
+		Field::Integer("limit"),
+	});
+
+	addHandler("SpineToc", Request::Method::Get, "/spineToc", accessControlFn,
+			[] (HandlerMap::Handler &h) -> data::Value {
+		auto &query = h.getQueryFields();
+		if (auto e = ExternalSession::get(h.getRequest())) {
+			auto project = query.isInteger("project") ? query.getInteger("project") : e->getInteger("project");
+			return ApiCall(h.getRequest()).getSpineToc(e->getUser(), project, query.getInteger("node"),
+					size_t(std::max(query.getInteger("depth", 2), int64_t(1))));
+		}
+		return data::Value();
+	}, data::Value({ pair("location", data::Value("target")) })).addQueryFields({
+		Field::Integer("project"),
+		Field::Integer("node"),
+		Field::Integer("depth"),
+	});
+
+	addHandler("SpineNavigation", Request::Method::Get, "/spineNavigation", accessControlFn,
+			[] (HandlerMap::Handler &h) -> data::Value {
+		auto &query = h.getQueryFields();
+		if (auto e = ExternalSession::get(h.getRequest())) {
+			auto project = query.isInteger("project") ? query.getInteger("project") : e->getInteger("project");
+			return ApiCall(h.getRequest()).getSpineNavigation(e->getUser(), project, query.getInteger("node"));
+		}
+		return data::Value();
+	}, data::Value({ pair("location", data::Value("target")) })).addQueryFields({
+		Field::Integer("project"),
+		Field::Integer("node", Flags::Required),
+	});
+
+	addHandler("SpineTags", Request::Method::Get, "/spineTags", accessControlFn,
+			[] (HandlerMap::Handler &h) -> data::Value {
+		auto &query = h.getQueryFields();
+		if (auto e = ExternalSession::get(h.getRequest())) {
+			auto project = query.isInteger("project") ? query.getInteger("project") : e->getInteger("project");
+			return ApiCall(h.getRequest()).getSpineTags(e->getUser(), project, query.getString("tag"));
+		}
+		return data::Value();
+	}, data::Value({ pair("location", data::Value("target")) })).addQueryFields({
+		Field::Integer("project"),
+		Field::Text("tag", MaxLength(256)),
+	});
 }
 
 NS_SA_EXT_END(lore)
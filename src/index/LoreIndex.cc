@@ -22,6 +22,7 @@ THE SOFTWARE.
 
 #include "LoreIndex.h"
 #include "LoreApi.h"
+#include "LoreWiki.h"
 #include "LoreUsersComponent.h"
 #include "Languages.h"
 
@@ -40,7 +41,7 @@ public:
 						exec.set("projects", move(projects));
 					}
 				} else {
-					if (auto proj = ApiCall(_request).getProject(s->getUser(), selected)) {
+					if (auto proj = ApiCall(_request).getProject(s->getUser(), selected, ApiCall::ProjectFields::Template)) {
 						exec.set("project", move(proj));
 					}
 				}
@@ -52,10 +53,51 @@ public:
 	}
 };
 
+class ContentHandler : public IndexHandlerInterface {
+public:
+	virtual int onRequest() override {
+		auto s = ExternalSession::get(_request);
+		if (!s) {
+			return HTTP_FORBIDDEN;
+		}
+
+		auto wiki = _request.server().getComponent<WikiComponent>();
+		auto obj = wiki->getLocaleForRender(_transaction, getQueryFields().getInteger("id"));
+		if (!obj || obj.getValue("content").getString("type") != WikiComponent::ContentTypeMarkdown) {
+			return HTTP_NOT_FOUND;
+		}
+
+		if (!ApiCall(_request).isProjectAllowed(s->getUser(), obj.getInteger("project"))) {
+			return HTTP_FORBIDDEN;
+		}
+
+		return _request.runPug("templates/content.pug", [&] (pug::Context &exec, const pug::Template &tpl) -> bool {
+			defineTemplateContext(exec);
+
+			// template is written directly into request, so head is already there, when content is reached:
+			// it's flushed to client, then html is streamed by chunks, without buffering of the whole page;
+			// stored html is used as is, markdown is rendered only when it's missing or outdated
+			exec.set("writeContent", [&] (pug::VarStorage &storage, pug::Var *args, size_t argc) -> pug::Var {
+				_request.flush();
+				wiki->writeContentHtml(_request, obj.getValue("content"), languages::getLanguage(obj.getString("language")));
+				return pug::Var();
+			});
+
+			defineErrors(exec);
+			return true;
+		});
+	}
+};
+
 class IndexHandlerMap : public HandlerMap {
 public:
 	IndexHandlerMap() {
+		using namespace db;
+
 		addHandler("Index", Request::Method::Get, "/", SA_HANDLER(IndexHandler));
+		addHandler("Content", Request::Method::Get, "/content", SA_HANDLER(ContentHandler)).addQueryFields({
+			Field::Integer("id", Flags::Required),
+		});
 	}
 };
 
@@ -169,7 +211,7 @@ void IndexHandlerInterface::defineTemplateContext(pug::Context &exec) {
 		auto u = session->getUser();
 		exec.set("sessionUserId", data::Value(u));
 		if (u) {
-			if (auto user = _component->getUsers()->getExternalUserScheme().get(_transaction, u)) {
+			if (auto user = ApiCall(_request).getUser(u, ApiCall::UserFields::Template)) {
 				if (auto provs = _component->getUsers()->getExternalUserScheme().getProperty(_transaction, u, "providers")) {
 					user.setValue(move(provs), "providers");
 				}
@@ -32,6 +32,8 @@ NS_SA_EXT_BEGIN(lore)
 WikiComponent::WikiComponent(Server &serv, const String &name, const data::Value &dict)
 : ServerComponent(serv, name.empty()?"Wiki":name, dict) {
 	exportValues(_projects, _sections, _pages, _locale, _images, _warnings, _grants);
+
+	_hyphensConfig = dict.getValue("hyphens");
 }
 
 void WikiComponent::init(const LoreComponent *c) {
@@ -42,6 +44,13 @@ void WikiComponent::init(const LoreComponent *c) {
 		Field::Text("content", MinLength(2), MaxLength(100_KiB)),
 		Field::Data("meta"),
 		Field::Integer("mtime"),
+
+		// pre-rendered html for markdown content, valid while hash matches content
+		Field::Text("html", MaxLength(ContentHtmlMaxSize), Flags::ForceExclude),
+		Field::Integer("hash"),
+
+		// full-text chunks as [language, text], collected within the same parse as html, used by "ts" view
+		Field::Data("fulltext", Flags::ForceExclude),
 	});
 
 	auto commonFields = Vector<Field>({
@@ -81,14 +90,16 @@ void WikiComponent::init(const LoreComponent *c) {
 			return transformOrdering(scheme, val);
 		})),
 
-		Field::Data("spine", Flags::ReadOnly, Flags::ForceExclude, AutoFieldDef{
+		// spine is written only by rebuild, changes of units only set time of change in spineStale
+		Field::Data("spine", Flags::ReadOnly, Flags::ForceExclude),
+		Field::Integer("spineStale", Flags::ReadOnly | Flags::Indexed, AutoFieldDef{
 			Vector<AutoFieldScheme>({
 				AutoFieldScheme( _projects, {"title", "name", "order"} ),
 				AutoFieldScheme( _sections, AutoFieldScheme::ReqVec({"title", "name", "order", "root"}), AutoFieldScheme::ReqVec{"project", "root"} ),
 				AutoFieldScheme( _pages, AutoFieldScheme::ReqVec({"title", "name", "section", "tags"}), AutoFieldScheme::ReqVec{"project", "section"} )
 			}),
 			DefaultFn([this] (const data::Value &data) -> data::Value {
-				return UnitSpineIndex::create(Transaction::acquire(), data.getInteger("__oid")).encode();
+				return markSpineStale(data.getInteger("__oid"));
 			})
 		}),
 
@@ -149,11 +160,22 @@ void WikiComponent::init(const LoreComponent *c) {
 		Field::Text("tags", MaxLength(1_KiB)),
 		Field::Integer("origin"),
 
+		Field::Integer("project", Flags::Indexed, DefaultFn([this] (const data::Value &val) -> data::Value {
+			if (auto id = getProjectIdForOrigin(val.getInteger("origin"))) { return data::Value(id); }
+			return data::Value();
+		})),
+
 		Field::Extra("content", Flags::ForceExclude, Vector<Field>(contentFields),
 				ReplaceFilterFn([this] (const Scheme &scheme, const data::Value &obj, const data::Value &origVal, data::Value &newVal) -> bool {
 			return doContentFilter(scheme, obj, origVal, newVal);
 		})),
 
+		Field::FullTextView("ts", FullTextViewFn([this] (const Scheme &scheme, const data::Value &obj) -> Vector<FullTextData> {
+			return getLocaleFullText(obj);
+		}), FullTextQueryFn([this] (const data::Value &input) -> Vector<FullTextData> {
+			return getSearchQuery(input);
+		}), Vector<String>{"title", "tags", "content"}),
+
 		Field::Set("images", _images, Flags::Composed),
 		Field::Image("cover", MaxImageSize(1080, 1080, ImagePolicy::Resize), Vector<Thumbnail>({
 			Thumbnail("cover512", 512, 512),
@@ -194,8 +216,10 @@ void WikiComponent::init(const LoreComponent *c) {
 	});
 
 
+	_externalUsers = &c->getUsers()->getExternalUserScheme();
+
 	_grants.define(Vector<Field>({
-		Field::Object("user", c->getUsers()->getExternalUserScheme(), RemovePolicy::Cascade),
+		Field::Object("user", *_externalUsers, RemovePolicy::Cascade),
 		Field::Object("project", _projects),
 		Field::Integer("role", data::Value(toInt(WikiRole::Nobody))),
 	}),
@@ -204,20 +228,494 @@ void WikiComponent::init(const LoreComponent *c) {
 }
 
 void WikiComponent::onChildInit(Server &serv) {
+	_hyphens = Rc<HyphenMap>::alloc(mem::pool::acquire());
+
+	// "hyphens": { "latin": <file>, "cyrillic": <file>, <language code>: { "latin": <file> } }
+	if (_hyphensConfig.isDictionary()) {
+		for (auto &it : _hyphensConfig.asDict()) {
+			if (it.first == "cyrillic") {
+				_hyphens->addHyphenDict(CharGroupId::Cyrillic, it.second.getString());
+			} else if (it.first == "latin") {
+				_hyphens->addHyphenDict(CharGroupId::Latin, it.second.getString());
+			} else if (it.second.isDictionary()) {
+				auto lang = languages::getLanguage(it.first);
+				for (auto &l_it : it.second.asDict()) {
+					if (l_it.first == "cyrillic") {
+						_hyphens->addHyphenDict(lang, CharGroupId::Cyrillic, l_it.second.getString());
+					} else if (l_it.first == "latin") {
+						_hyphens->addHyphenDict(lang, CharGroupId::Latin, l_it.second.getString());
+					}
+				}
+			}
+		}
+	}
+
+	addCommand("wiki-reprocess", [this] (const StringView &str) -> data::Value {
+		StringView r(str);
+		r.skipChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+		if (auto project = r.readInteger().get(0)) {
+			return reprocessProject(project);
+		}
+		return data::Value("Invalid project id");
+	}, "<project-id> - regenerate markdown meta and html for all project content");
+
+	// locale objects, created before project field was added, are filled once by admin, not by every child
+	addCommand("wiki-backfill-locale", [this] (const StringView &str) -> data::Value {
+		backfillLocaleProjects();
+		return data::Value("Locale project backfill scheduled");
+	}, "- fill project for locale objects, created before project field was added");
+}
+
+void WikiComponent::backfillLocaleProjects() {
+	// locale objects, created before project field was added, has no project; once filled, query finds nothing
+	Task::perform(_server, [&] (Task &task) {
+		task.addExecuteFn([this] (const Task &task) -> bool {
+			_server.performWithStorage([&] (const storage::Transaction &t) {
+				int64_t last = 0;
+				size_t updated = 0;
+				size_t orphans = 0;
+				while (true) {
+					auto objs = _locale.select(t, storage::Query()
+						.select("project", storage::Comparation::IsNull, data::Value(true))
+						.select("__oid", storage::Comparation::GreatherThen, data::Value(last))
+						.order("__oid").limit(LocaleBackfillBatchSize).include("origin"));
+					if (!objs.isArray() || objs.size() == 0) {
+						break;
+					}
+
+					t.perform([&] {
+						for (auto &it : objs.asArray()) {
+							last = it.getInteger("__oid");
+							if (auto project = getProjectIdForOrigin(it.getInteger("origin"))) {
+								if (_locale.update(t, it, data::Value({
+									pair("project", data::Value(project))
+								}), storage::UpdateFlags::NoReturn)) {
+									++ updated;
+								}
+							} else {
+								++ orphans;
+							}
+						}
+						return true;
+					});
+				}
+
+				if (updated || orphans) {
+					messages::local("Wiki", "Locale project backfill finished", data::Value({
+						pair("updated", data::Value(int64_t(updated))),
+						pair("orphans", data::Value(int64_t(orphans))),
+					}));
+				}
+			});
+			return true;
+		});
+	});
+}
+
+void WikiComponent::scheduleStaleSpines() {
+	// scheduled updates are lost with process, that scheduled them; spines, changed recently,
+	// are still scheduled in other processes, so only ones, that should be rebuilt long ago, are taken
+	auto limit = Time::now().toMicros() - SpineUpdateMaxDelay * 2;
+	Task::perform(_server, [&] (Task &task) {
+		task.addExecuteFn([this, limit] (const Task &task) -> bool {
+			_server.performWithStorage([&] (const storage::Transaction &t) {
+				int64_t last = 0;
+				while (true) {
+					auto objs = _projects.select(t, storage::Query()
+						.select("spineStale", storage::Comparation::BetweenValues, data::Value(0), data::Value(int64_t(limit)))
+						.select("__oid", storage::Comparation::GreatherThen, data::Value(last))
+						.order("__oid").limit(StaleSpineBatchSize).include("spineStale"));
+					if (!objs.isArray() || objs.size() == 0) {
+						break;
+					}
+
+					for (auto &it : objs.asArray()) {
+						last = it.getInteger("__oid");
+						scheduleSpineUpdate(last);
+					}
+				}
+			});
+			return true;
+		});
+	});
+}
+
+void WikiComponent::scheduleSpineUpdate(int64_t project) {
+	auto now = Time::now();
+
+	std::unique_lock<Mutex> lock(_spineMutex);
+	auto it = _spineUpdates.find(project);
+	if (it == _spineUpdates.end()) {
+		_spineUpdates.emplace(project, SpineUpdate{now, now});
+	} else {
+		it->second.last = now;
+	}
+}
+
+void WikiComponent::performSpineUpdates() {
+	if (!_staleSpinesScheduled.exchange(true)) {
+		scheduleStaleSpines();
+	}
+
+	Vector<int64_t> ready;
+	auto now = Time::now();
+
+	{
+		std::unique_lock<Mutex> lock(_spineMutex);
+		auto it = _spineUpdates.begin();
+		while (it != _spineUpdates.end()) {
+			if (now - it->second.last >= TimeInterval::microseconds(SpineUpdateDelay)
+					|| now - it->second.first >= TimeInterval::microseconds(SpineUpdateMaxDelay)) {
+				ready.emplace_back(it->first);
+				it = _spineUpdates.erase(it);
+			} else {
+				++ it;
+			}
+		}
+	}
+
+	if (ready.empty()) {
+		return;
+	}
+
+	// all ready projects are rebuilt within single task
+	Task::perform(_server, [&] (Task &task) {
+		task.addExecuteFn([this, ready = Vector<int64_t>(ready)] (const Task &task) -> bool {
+			_server.performWithStorage([&] (const storage::Transaction &t) {
+				for (auto &it : ready) {
+					auto spine = UnitSpineIndex::update(t, it);
+					storage::Worker(_projects, t).asSystem().update(it, data::Value({
+						pair("spine", spine.encode()),
+						pair("spineStale", data::Value(0)),
+					}));
+					invalidateCachedSpine(it);
+				}
+			});
+			return true;
+		});
+	});
+}
+
+WikiComponent::CachedSpine::CachedSpine(const data::Value &spine, bool isStale) {
+	auto &binVal = spine.getBytes("bin");
+	bin.assign((const char *)binVal.data(), binVal.size());
+
+	// [tag, pages count, encoded page ids]
+	auto &tagsVal = spine.getValue("tags");
+	if (tagsVal.isArray()) {
+		tags.reserve(tagsVal.size());
+		postings.reserve(tagsVal.size());
+		for (auto &it : tagsVal.asArray()) {
+			auto &tag = it.getString(0);
+			auto &pages = it.getBytes(2);
+			tags.emplace_back(std::string(tag.data(), tag.size()), size_t(it.getInteger(1)));
+			postings.emplace_back(std::string((const char *)pages.data(), pages.size()));
+		}
+	}
+	stale = isStale;
+}
+
+size_t WikiComponent::CachedSpine::size() const {
+	auto ret = sizeof(CachedSpine) + bin.size();
+	for (auto &it : tags) {
+		ret += sizeof(it) + it.first.size();
+	}
+	for (auto &it : postings) {
+		ret += sizeof(it) + it.size();
+	}
+	return ret;
+}
+
+std::shared_ptr<const WikiComponent::CachedSpine> WikiComponent::getCachedSpine(int64_t project) const {
+	auto now = Time::now();
+
+	std::unique_lock<Mutex> lock(_spineCacheMutex);
+	auto it = _spineCacheIndex.find(project);
+	if (it == _spineCacheIndex.end() || now - it->second->checked >= TimeInterval::microseconds(SpineCacheCheckInterval)) {
+		return nullptr;
+	}
+
+	_spineCache.splice(_spineCache.begin(), _spineCache, it->second);
+	return it->second->data;
+}
+
+std::shared_ptr<const WikiComponent::CachedSpine> WikiComponent::getCachedSpine(int64_t project, int64_t mtime) const {
+	std::unique_lock<Mutex> lock(_spineCacheMutex);
+	auto it = _spineCacheIndex.find(project);
+	if (it == _spineCacheIndex.end() || it->second->mtime != mtime) {
+		return nullptr;
+	}
+
+	it->second->checked = Time::now();
+	_spineCache.splice(_spineCache.begin(), _spineCache, it->second);
+	return it->second->data;
+}
+
+void WikiComponent::setCachedSpine(int64_t project, int64_t mtime, const std::shared_ptr<const CachedSpine> &spine) const {
+	auto size = spine->size();
+	if (size > SpineCacheCapacity / 4) {
+		return;
+	}
+
+	std::unique_lock<Mutex> lock(_spineCacheMutex);
+	auto it = _spineCacheIndex.find(project);
+	if (it != _spineCacheIndex.end()) {
+		_spineCacheSize -= it->second->data->size();
+		_spineCache.erase(it->second);
+		_spineCacheIndex.erase(it);
+	}
+
+	_spineCache.emplace_front(SpineCacheEntry{project, mtime, Time::now(), spine});
+	_spineCacheIndex.emplace(project, _spineCache.begin());
+	_spineCacheSize += size;
+
+	while (_spineCacheSize > SpineCacheCapacity && !_spineCache.empty()) {
+		auto &last = _spineCache.back();
+		_spineCacheSize -= last.data->size();
+		_spineCacheIndex.erase(last.project);
+		_spineCache.pop_back();
+	}
+}
+
+void WikiComponent::invalidateCachedSpine(int64_t project) const {
+	std::unique_lock<Mutex> lock(_spineCacheMutex);
+	auto it = _spineCacheIndex.find(project);
+	if (it != _spineCacheIndex.end()) {
+		_spineCacheSize -= it->second->data->size();
+		_spineCache.erase(it->second);
+		_spineCacheIndex.erase(it);
+	}
+}
+
+data::Value WikiComponent::markSpineStale(int64_t project) {
+	// readers get last built spine with stale flag, until scheduled rebuild is performed;
+	// spine data is not read or written here
+	invalidateCachedSpine(project);
+	scheduleSpineUpdate(project);
+	return data::Value(int64_t(Time::now().toMicros()));
+}
+
+data::Value WikiComponent::ReprocessStat::encode() const {
+	auto elapsed = (Time::now() - start).toMicros();
+	auto done = processed.load();
+	return data::Value({
+		pair("project", data::Value(project)),
+		pair("processed", data::Value(int64_t(done))),
+		pair("failed", data::Value(int64_t(failed.load()))),
+		pair("unscheduled", data::Value(int64_t(unscheduled.load()))),
+		pair("bytes", data::Value(int64_t(bytes.load()))),
+		pair("elapsed", data::Value(int64_t(elapsed))),
+		pair("perSecond", data::Value(elapsed ? double(done) * 1'000'000.0 / double(elapsed) : 0.0)),
+		pair("batchesLeft", data::Value(int64_t(batches - completed.load() - unscheduled.load()))),
+	});
+}
+
+WikiComponent::ReprocessStat::~ReprocessStat() {
+	messages::local("Wiki", "Project reprocessing finished", encode());
+}
+
+data::Value WikiComponent::reprocessProject(int64_t project) {
+	auto t = storage::Transaction::acquire();
+	if (!t || !_projects.get(t, project, {"name"})) {
+		return data::Value("Project not found");
+	}
+
+	// locale objects are owned by project, its sections and its pages;
+	// owners are split into id ranges, so every batch reads all its locale with single select
+	Vector<ReprocessBatch> batches;
+	batches.emplace_back(ReprocessBatch{&_projects, project, project, 1});
+
+	size_t owners = 1;
+	auto addBatches = [&] (const Scheme &scheme) {
+		auto ids = scheme.select(t, storage::Query().select("project", data::Value(project)).order("__oid").include("__oid"));
+		auto &arr = ids.asArray();
+		for (size_t i = 0; i < arr.size(); i += ReprocessBatchSize) {
+			auto end = std::min(i + ReprocessBatchSize, arr.size());
+			batches.emplace_back(ReprocessBatch{&scheme, arr[i].getInteger("__oid"), arr[end - 1].getInteger("__oid"), end - i});
+		}
+		owners += arr.size();
+	};
+
+	addBatches(_sections);
+	addBatches(_pages);
+
+	auto stat = std::make_shared<ReprocessStat>();
+	stat->project = project;
+	stat->owners = owners;
+	stat->batches = batches.size();
+	stat->start = Time::now();
+	stat->completed = 0;
+	stat->unscheduled = 0;
+	stat->processed = 0;
+	stat->failed = 0;
+	stat->bytes = 0;
+
+	for (auto &it : batches) {
+		auto scheduled = Task::perform(_server, [&] (Task &task) {
+			task.addExecuteFn([this, stat, batch = it] (const Task &task) -> bool {
+				reprocessBatch(stat.get(), batch);
+				return true;
+			});
+			task.addCompleteFn([stat] (const Task &task, bool success) {
+				++ stat->completed;
+				messages::local("Wiki", "Project reprocessing progress", stat->encode());
+			});
+		});
+
+		if (!scheduled) {
+			++ stat->unscheduled;
+			stat->failed += it.count;
+		}
+	}
+
+	return data::Value({
+		pair("project", data::Value(project)),
+		pair("owners", data::Value(int64_t(owners))),
+		pair("batches", data::Value(int64_t(batches.size()))),
+		pair("unscheduled", data::Value(int64_t(stat->unscheduled.load()))),
+	});
+}
+
+void WikiComponent::reprocessBatch(ReprocessStat *stat, const ReprocessBatch &batch) const {
+	_server.performWithStorage([&] (const storage::Transaction &t) {
+		storage::Query q;
+		if (batch.scheme == &_projects) {
+			q.select(batch.first);
+		} else {
+			q.select("project", data::Value(stat->project))
+				.select("__oid", storage::Comparation::GreatherOrEqual, data::Value(batch.first))
+				.select("__oid", storage::Comparation::LessOrEqual, data::Value(batch.last));
+		}
+		q.include(storage::Query::Field("locale", {"language", "content"}));
+
+		auto owners = batch.scheme->select(t, q);
+
+		// whole batch is written in single transaction
+		t.perform([&] {
+			for (auto &it : owners.asArray()) {
+				auto &locale = it.getValue("locale");
+				if (!locale.isArray()) {
+					continue;
+				}
 
+				for (auto &l : locale.asArray()) {
+					auto &content = l.getValue("content");
+					if (!StringView(content.getString("type")).starts_with(ContentTypeMarkdown)) {
+						continue;
+					}
+
+					auto &source = content.getString("content");
+					stat->bytes += source.size();
+					if (_locale.update(t, l, data::Value({
+						pair("project", data::Value(stat->project)),
+						pair("content", data::Value({
+							pair("type", data::Value(ContentTypeMarkdownReprocess)),
+							pair("content", data::Value(source)),
+						}))
+					}), storage::UpdateFlags::NoReturn)) {
+						++ stat->processed;
+					} else {
+						++ stat->failed;
+					}
+				}
+			}
+			return true;
+		});
+	});
+}
+
+data::Value WikiComponent::getLocaleForRender(const db::Transaction &t, int64_t locale) const {
+	auto ret = _locale.select(t, db::Query().select(locale)
+			.include("language").include("project")
+			.include(db::Query::Field("content", {"type", "content", "meta", "hash", "html"})));
+	if (ret.isArray() && ret.size() == 1) {
+		return move(ret.getValue(0));
+	}
+	return data::Value();
+}
+
+bool WikiComponent::writeContentHtml(std::ostream &stream, const data::Value &content, languages::Language lang) const {
+	if (content.getString("type") != ContentTypeMarkdown) {
+		return false;
+	}
+
+	auto &source = content.getString("content");
+	auto &html = content.getValue("html");
+	if (html.isString()) {
+		if (source.empty() || content.getInteger("hash") == int64_t(hash::hash64(source.data(), source.size()))) {
+			StringView r(html.getString());
+			while (!r.empty()) {
+				auto chunk = r.readChars(HtmlChunkSize);
+				stream.write(chunk.data(), chunk.size());
+				stream.flush();
+			}
+			return true;
+		}
+	}
+
+	if (source.empty()) {
+		return false;
+	}
+
+	writeHtmlHyphChunked(stream, mem::pool::acquire(), source, _hyphens, HtmlChunkSize, stappler::mmd::StapplerExtensions,
+			content.getValue("meta"), lang);
+	return true;
 }
 
 bool WikiComponent::doContentFilter(const Scheme &scheme, const data::Value &obj, const data::Value &origValue, data::Value &newValue) {
-	if (newValue.getString("type") == "text/markdown") {
+	bool reprocess = false;
+	if (newValue.getString("type") == ContentTypeMarkdownReprocess) {
+		// requested by wiki-reprocess: ignore previous results, even when source is the same
+		newValue.setString(ContentTypeMarkdown, "type");
+		reprocess = true;
+	}
+
+	if (newValue.getString("type") == ContentTypeMarkdown) {
+		auto &source = newValue.getString("content");
+		auto sourceHash = int64_t(hash::hash64(source.data(), source.size()));
+
+		if (!reprocess && origValue.getString("type") == ContentTypeMarkdown && origValue.getInteger("hash") == sourceHash
+				&& origValue.isDictionary("meta") && origValue.isString("html") && origValue.isArray("fulltext")) {
+			// content was not changed, previous meta, html and full-text chunks are still valid
+			newValue.setValue(origValue.getValue("meta"), "meta");
+			newValue.setValue(origValue.getValue("html"), "html");
+			newValue.setValue(origValue.getValue("fulltext"), "fulltext");
+			newValue.setInteger(sourceHash, "hash");
+			newValue.setInteger(origValue.getInteger("mtime"), "mtime");
+			return true;
+		}
+
+		StringStream html;
+		data::Value fulltext;
+		auto split = [&] (const StringView &str, search::Language lang) {
+			fulltext.addValue(data::Value({ data::Value(int64_t(lang)), data::Value(str) }));
+		};
+		Callback<void(const StringView &, search::Language)> splitCallback(split);
+
 		newValue.erase("meta");
-		newValue.setValue(processMarkdown(Request(mem::request()).pool(), newValue.getString("content"),
-			(origValue.getString("type") == "text/markdown") ? origValue.getValue("meta") : data::Value()), "meta");
+		newValue.setValue(processMarkdown(mem::pool::acquire(), source, &splitCallback, &html, _hyphens,
+			languages::getLanguage(obj.getString("language"))), "meta");
+		newValue.setValue(move(fulltext), "fulltext");
+		// html with hyphenation is larger, than source; when it's too large, it's rendered on request
+		auto str = html.str();
+		if (str.size() <= ContentHtmlMaxSize) {
+			newValue.setString(move(str), "html");
+		} else {
+			newValue.erase("html");
+		}
+		newValue.setInteger(sourceHash, "hash");
 		newValue.setInteger(Time::now().toMicroseconds(), "mtime");
-	} else if (newValue.getString("type") == "text/markdown;forced") {
-		newValue.setString("text/markdown", "type");
+	} else if (newValue.getString("type") == ContentTypeMarkdownForced) {
+		newValue.setString(ContentTypeMarkdown, "type");
+		newValue.erase("html");
+		newValue.erase("hash");
+		newValue.erase("fulltext");
 		return true;
 	} else {
 		newValue.erase("meta");
+		newValue.erase("html");
+		newValue.erase("hash");
+		newValue.erase("fulltext");
 	}
 	return true;
 }
@@ -243,6 +741,15 @@ bool WikiComponent::transformOrdering(const db::Scheme &scheme, data::Value &val
 	return false;
 }
 
+void WikiComponent::bumpGrantsVersion(const db::Transaction &t, int64_t user) const {
+	if (user) {
+		// time-based version, so concurrent writers do not need to read previous one
+		storage::Worker(*_externalUsers, t).asSystem().update(user, data::Value({
+			pair("grantsVersion", data::Value(int64_t(Time::now().toMicros())))
+		}));
+	}
+}
+
 int64_t WikiComponent::getProjectIdForSection(int64_t id) const {
 	if (id) {
 		if (auto storage = storage::Adapter::FromContext()) {
@@ -267,4 +774,73 @@ int64_t WikiComponent::getProjectIdForPage(int64_t id) const {
 	return 0;
 }
 
+int64_t WikiComponent::getProjectIdForOrigin(int64_t id) const {
+	if (id) {
+		if (auto storage = storage::Adapter::FromContext()) {
+			if (auto projId = storage::Worker(_pages, storage).get(id, {"project"}).getInteger("project")) {
+				return projId;
+			}
+			if (auto projId = storage::Worker(_sections, storage).get(id, {"project"}).getInteger("project")) {
+				return projId;
+			}
+			if (auto proj = storage::Worker(_projects, storage).get(id, {"name"})) {
+				return proj.getInteger("__oid");
+			}
+		}
+	}
+	return 0;
+}
+
+Vector<FullTextData> WikiComponent::getLocaleFullText(const data::Value &obj) const {
+	Vector<FullTextData> ret;
+
+	auto &title = obj.getString("title");
+	if (!title.empty()) {
+		ret.emplace_back(FullTextData{title, search::detectLanguage(title), FullTextData::A});
+	}
+
+	auto &tags = obj.getString("tags");
+	if (!tags.empty()) {
+		ret.emplace_back(FullTextData{tags, search::detectLanguage(tags), FullTextData::B});
+	}
+
+	// markdown chunks are stored by content filter; forced content is not parsed until reprocessing,
+	// so it's indexed as plain text
+	auto &content = obj.getValue("content");
+	auto &source = content.getString("content");
+	if (!source.empty()) {
+		if (content.isArray("fulltext")) {
+			for (auto &it : content.getArray("fulltext")) {
+				ret.emplace_back(FullTextData{it.getString(1), search::Language(it.getInteger(0)), FullTextData::C});
+			}
+		} else {
+			ret.emplace_back(FullTextData{source, search::detectLanguage(source), FullTextData::C});
+		}
+	}
+
+	return ret;
+}
+
+Vector<FullTextData> WikiComponent::getSearchQuery(const data::Value &input) const {
+	// query words are grouped by language, same way as content words
+	Vector<Pair<search::Language, String>> words;
+	StringView(input.getString()).split<StringView::CharGroup<CharGroupId::WhiteSpace>>([&] (const StringView &word) {
+		auto lang = search::detectLanguage(word);
+		for (auto &it : words) {
+			if (it.first == lang) {
+				it.second.push_back(' ');
+				it.second.append(word.data(), word.size());
+				return;
+			}
+		}
+		words.emplace_back(lang, word.str());
+	});
+
+	Vector<FullTextData> ret;
+	for (auto &it : words) {
+		ret.emplace_back(FullTextData{move(it.second), it.first});
+	}
+	return ret;
+}
+
 NS_SA_EXT_END(lore)
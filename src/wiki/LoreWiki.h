@@ -25,12 +25,102 @@ THE SOFTWARE.
 
 #include "Lore.h"
 #include "MMDEngine.h"
+#include "Languages.h"
 
 // hyphenator forward declaration
 typedef struct _HyphenDict HyphenDict;
 
 NS_SA_EXT_BEGIN(lore)
 
+class HyphenMap : public SharedObject {
+public:
+	enum class Script : uint8_t {
+		Unknown,
+		Latin,
+		Cyrillic,
+		Max
+	};
+
+	// dictionary encodings, supported by word encoder
+	enum class Charset : uint8_t {
+		Unknown,
+		Utf8,
+		Koi8r,
+		Latin1, // ISO8859-1
+	};
+
+	// compiled dictionary, mapped read-only from '<dict>.hyb' file, so its pages are shared between server processes
+	struct Binary;
+
+	static Script getScript(char32_t);
+
+	// default dictionary for script
+	void addHyphenDict(CharGroupId id, const String &file);
+
+	// language-specific dictionary, preferred over script default when text language matches
+	void addHyphenDict(languages::Language, CharGroupId id, const String &file);
+
+	Vector<uint8_t> makeWordHyphens(const char16_t *ptr, size_t len, languages::Language = languages::Language::Unknown);
+	Vector<uint8_t> makeWordHyphens(const WideStringView &, languages::Language = languages::Language::Unknown);
+	void purgeHyphenDicts();
+
+	void hyphenateWord(std::ostream &, const StringViewUtf8 & wordReader, languages::Language = languages::Language::Unknown);
+
+	uint64_t getCacheHits() const { return _cacheHits.load(); }
+	uint64_t getCacheMisses() const { return _cacheMisses.load(); }
+
+	HyphenMap(mem::pool_t *p) : SharedObject(p) { }
+	virtual ~HyphenMap() { purgeHyphenDicts(); }
+
+protected:
+	static constexpr size_t LanguageCount = static_cast<size_t>(languages::Language::_zh) + 1;
+	static constexpr size_t ScriptCount = static_cast<size_t>(Script::Max);
+
+	// word cache is shared between request threads, so it uses malloc-based std containers instead of pools
+	static constexpr size_t CacheShards = 16;
+	static constexpr size_t CacheShardCapacity = 4096;
+
+	static constexpr size_t MaxWordLength = 254;
+
+	// compiled dictionary is preferred, libhyphen one is used for patterns, that can not be compiled
+	struct DictEntry {
+		const Binary *binary = nullptr;
+		HyphenDict *dict = nullptr;
+		Script script = Script::Unknown;
+		Charset charset = Charset::Unknown;
+	};
+
+	struct CacheShard {
+		// byte offsets within UTF-8 word, after which soft hyphen should be placed
+		using List = std::list<std::pair<std::string, std::vector<uint16_t>>>;
+
+		Mutex mutex;
+		List list; // most recently used first
+		std::unordered_map<std::string_view, List::iterator> index;
+	};
+
+	String convertWord(const DictEntry &, const char16_t *ptr, size_t len);
+
+	// sets break flag for every char of encoded word, after which hyphen is allowed
+	void hyphenateEncoded(const DictEntry &, const char *word, size_t wordLen, size_t len, uint8_t *breaks) const;
+
+	const DictEntry *getDict(char32_t, languages::Language) const;
+	void loadDict(DictEntry &, Script, const String &file);
+	void freeDict(DictEntry &);
+
+	// hyphens buffer should have space for MaxWordLength offsets
+	bool getCachedHyphens(const StringView &, uint16_t *hyphens, size_t &count);
+	void setCachedHyphens(const StringView &, const uint16_t *hyphens, size_t count);
+	void clearCachedHyphens();
+
+	std::array<DictEntry, ScriptCount> _scripts;
+	std::array<DictEntry, LanguageCount> _languages;
+
+	std::array<CacheShard, CacheShards> _cache;
+	std::atomic<uint64_t> _cacheHits = 0;
+	std::atomic<uint64_t> _cacheMisses = 0;
+};
+
 enum class WikiRole {
 	Nobody,
 	Reader,
@@ -48,6 +138,12 @@ public:
 
 	virtual void onChildInit(Server &) override;
 
+	// locale object with content, pre-rendered html included, it's excluded from content by default
+	data::Value getLocaleForRender(const db::Transaction &, int64_t locale) const;
+
+	// writes rendered html for locale content object, uses pre-rendered html, when it's valid
+	bool writeContentHtml(std::ostream &, const data::Value &content, languages::Language = languages::Language::Unknown) const;
+
 	bool doContentFilter(const Scheme &, const data::Value &obj, const data::Value &origValue, data::Value &newValue);
 	bool transformOrdering(const db::Scheme &scheme, data::Value &val);
 
@@ -59,9 +155,121 @@ public:
 	const Scheme & getWarnings() const { return _warnings; }
 	const Scheme & getGrants() const { return _grants; }
 
+	// should be called with every grants write for user, so grants snapshots in sessions are dropped
+	void bumpGrantsVersion(const db::Transaction &, int64_t user) const;
+
+	const Rc<HyphenMap> &getHyphens() const { return _hyphens; }
+
+	// limit for pre-rendered html, hyphenation marks and block ids make it several times larger, than 100_KiB source
+	static constexpr size_t ContentHtmlMaxSize = 512_KiB;
+
+	// content types for markdown locale content:
+	// ContentTypeMarkdownForced - store source as is, meta and html are generated later by reprocessing;
+	// ContentTypeMarkdownReprocess - regenerate meta and html, even when source was not changed
+	static constexpr StringView ContentTypeMarkdown = "text/markdown";
+	static constexpr StringView ContentTypeMarkdownForced = "text/markdown;forced";
+	static constexpr StringView ContentTypeMarkdownReprocess = "text/markdown;reprocess";
+
+	// regenerates meta and html for all locale content of project, work is split between server task threads
+	data::Value reprocessProject(int64_t project);
+
+	// marks project spine as outdated, it will be rebuilt on heartbeat, after edits settle down
+	void scheduleSpineUpdate(int64_t project);
+
+	// rebuilds scheduled spines in background task, called on heartbeat; first call also schedules stale spines
+	void performSpineUpdates();
+
+	// schedules rebuild for spines, left stale by processes, that were stopped before rebuild
+	void scheduleStaleSpines();
+
+	// binary spine with tags, copied out of pools to be shared between threads, used in place without decoding
+	struct CachedSpine {
+		CachedSpine(const data::Value &, bool stale);
+
+		std::string bin;
+		std::vector<std::pair<std::string, size_t>> tags;
+		std::vector<std::string> postings;
+		bool stale = false;
+
+		size_t size() const;
+	};
+
+	// process-wide cache of stored spines, entry is valid only for the same project mtime;
+	// without mtime, entry is returned, only if its mtime was verified within SpineCacheCheckInterval
+	std::shared_ptr<const CachedSpine> getCachedSpine(int64_t project) const;
+	std::shared_ptr<const CachedSpine> getCachedSpine(int64_t project, int64_t mtime) const;
+	void setCachedSpine(int64_t project, int64_t mtime, const std::shared_ptr<const CachedSpine> &) const;
+	void invalidateCachedSpine(int64_t project) const;
+
 protected:
+	static constexpr size_t ReprocessBatchSize = 32;
+
+	// shared by batch tasks, final stats are reported, when last task releases it
+	struct ReprocessStat {
+		int64_t project = 0;
+		size_t owners = 0;
+		size_t batches = 0;
+		Time start;
+		std::atomic<size_t> completed;
+		std::atomic<size_t> unscheduled;
+		std::atomic<size_t> processed;
+		std::atomic<size_t> failed;
+		std::atomic<size_t> bytes;
+
+		data::Value encode() const;
+
+		~ReprocessStat();
+	};
+
+	// owners of the same scheme within id range, selected with their locale by single query
+	struct ReprocessBatch {
+		const Scheme *scheme;
+		int64_t first;
+		int64_t last;
+		size_t count;
+	};
+
+	void reprocessBatch(ReprocessStat *, const ReprocessBatch &) const;
+
+	// spine is rebuilt after no changes for SpineUpdateDelay, but no later than SpineUpdateMaxDelay after first change
+	static constexpr uint64_t SpineUpdateDelay = 1'000'000; // microseconds
+	static constexpr uint64_t SpineUpdateMaxDelay = 10'000'000;
+
+	static constexpr size_t StaleSpineBatchSize = 64;
+
+	struct SpineUpdate {
+		Time first;
+		Time last;
+	};
+
+	// returns time of change for spineStale field and schedules spine rebuild
+	data::Value markSpineStale(int64_t project);
+
+	static constexpr size_t SpineCacheCapacity = 32_MiB;
+
+	// spine in other processes is rebuilt with the same delay, so short trust interval is not noticeable
+	static constexpr uint64_t SpineCacheCheckInterval = 1'000'000; // microseconds
+
+	struct SpineCacheEntry {
+		int64_t project;
+		int64_t mtime;
+		Time checked;
+		std::shared_ptr<const CachedSpine> data;
+	};
+
+	using SpineCacheList = std::list<SpineCacheEntry>;
+
+	static constexpr size_t LocaleBackfillBatchSize = 256;
+
+	// fills project for existing locale objects from their owners in background task, started by wiki-backfill-locale
+	void backfillLocaleProjects();
+
 	int64_t getProjectIdForSection(int64_t) const;
 	int64_t getProjectIdForPage(int64_t) const;
+	int64_t getProjectIdForOrigin(int64_t) const;
+
+	Vector<FullTextData> getLocaleFullText(const data::Value &obj) const;
+	Vector<FullTextData> getSearchQuery(const data::Value &input) const;
 
 	Scheme _projects = Scheme("lore_projects");
 	Scheme _sections = Scheme("lore_sections");
@@ -70,12 +278,26 @@ protected:
 	Scheme _images = Scheme("lore_images");
 	Scheme _warnings = Scheme("lore_warnings");
 	Scheme _grants = Scheme("lore_wiki_grants");
+
+	const Scheme *_externalUsers = nullptr;
+
+	data::Value _hyphensConfig;
+	Rc<HyphenMap> _hyphens;
+
+	Mutex _spineMutex;
+	std::map<int64_t, SpineUpdate> _spineUpdates;
+	std::atomic<bool> _staleSpinesScheduled = false;
+
+	mutable Mutex _spineCacheMutex;
+	mutable SpineCacheList _spineCache; // most recently used first
+	mutable std::unordered_map<int64_t, SpineCacheList::iterator> _spineCacheIndex;
+	mutable size_t _spineCacheSize = 0;
 };
 
 struct UnitSpineIndex {
 	using VectorIndex = Vector<Pair<int64_t, const data::Value *>>;
 
-	enum class Type {
+	enum class Type : uint8_t {
 		Unit,
 		Section,
 		Page
@@ -103,7 +325,83 @@ struct UnitSpineIndex {
 		size_t depth = 0;
 
 		static Node decode(data::Value &&);
-		void writeEncoded();
+	};
+
+	// Spine is stored in 'spine' field as { bin: <bytes>, tags: [[<tag>, <count>, <postings>], ...] },
+	// where postings are ids of tagged pages in ascending order, as varint-encoded deltas,
+	// and bin is a columnar blob: header, then int64 columns (id, parent, prev, next, priority), child links,
+	// uint32 columns (ordered and unordered child ranges, title, name and tags in string table), depth, type, flags, strings.
+	// Node ids are sorted, so nodes are located with binary search and read without decoding whole spine.
+	// Pending rebuild is marked with time of change in indexed 'spineStale' field, so it's set and scanned without spine data.
+	static constexpr uint32_t BinaryMagic = 0x4e50534c; // "LSPN"
+	static constexpr uint16_t BinaryVersion = 2;
+
+	struct BinaryHeader {
+		uint32_t magic;
+		uint16_t version;
+		uint16_t flags;
+		uint32_t count;
+		uint32_t links;
+		uint32_t strings;
+		uint32_t reserved;
+		int64_t unit;
+		int64_t mtime; // latest mtime of sections and pages, reflected in spine
+	};
+
+	struct Columns {
+		uint32_t count = 0;
+		const int64_t *ids = nullptr;
+		const int64_t *parents = nullptr;
+		const int64_t *prevs = nullptr;
+		const int64_t *nexts = nullptr;
+		const int64_t *priorities = nullptr;
+		const int64_t *links = nullptr;
+		const uint32_t *ordered = nullptr; // count + 1 offsets in links
+		const uint32_t *unordered = nullptr; // count + 1 offsets in links
+		const uint32_t *titleOffsets = nullptr;
+		const uint32_t *titleSizes = nullptr;
+		const uint32_t *nameOffsets = nullptr;
+		const uint32_t *nameSizes = nullptr;
+		const uint32_t *tagsOffsets = nullptr;
+		const uint32_t *tagsSizes = nullptr;
+		const uint16_t *depths = nullptr;
+		const uint8_t *types = nullptr;
+		const uint8_t *flags = nullptr;
+		const char *strings = nullptr;
+	};
+
+	struct Links {
+		const int64_t *ptr = nullptr;
+		size_t count = 0;
+
+		const int64_t *begin() const { return ptr; }
+		const int64_t *end() const { return ptr + count; }
+		size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+	};
+
+	// lightweight accessor for node in binary spine, no allocations
+	struct NodeView {
+		const Columns *columns = nullptr;
+		uint32_t slot = 0;
+
+		explicit operator bool() const { return columns != nullptr; }
+
+		int64_t getId() const { return columns->ids[slot]; }
+		int64_t getParent() const { return columns->parents[slot]; }
+		int64_t getPrev() const { return columns->prevs[slot]; }
+		int64_t getNext() const { return columns->nexts[slot]; }
+		int64_t getPriority() const { return columns->priorities[slot]; }
+		size_t getDepth() const { return columns->depths[slot]; }
+		Type getType() const { return Type(columns->types[slot]); }
+		bool isExcluded() const { return columns->flags[slot] & 1; }
+
+		StringView getTitle() const { return StringView(columns->strings + columns->titleOffsets[slot], columns->titleSizes[slot]); }
+		StringView getName() const { return StringView(columns->strings + columns->nameOffsets[slot], columns->nameSizes[slot]); }
+		StringView getTags() const { return StringView(columns->strings + columns->tagsOffsets[slot], columns->tagsSizes[slot]); }
+
+		Links getOrdered() const;
+		Links getUnordered() const;
 	};
 
 	static UnitSpineIndex create(const Request &, int64_t unit);
@@ -112,49 +410,76 @@ struct UnitSpineIndex {
 	static UnitSpineIndex get(const Request &, int64_t unit);
 	static UnitSpineIndex get(const storage::Transaction &, int64_t unit);
 
+	// rebuilds whole spine, but loads complete objects only for sections and pages, modified since last build,
+	// others are restored from stored spine (only their ids are selected); falls back to create, if stored spine
+	// is missing or inconsistent
+	static UnitSpineIndex update(const storage::Transaction &, int64_t unit);
+
+	// for binary spine, node is decoded on first access
 	const Node *getNode(int64_t) const;
 
+	NodeView getNodeView(int64_t) const;
+
+	size_t size() const;
+
+	// ids of pages with tag, in ascending order
+	Vector<int64_t> getTagPages(const StringView &) const;
+
 	data::Value encode() const;
 
 	int64_t unit = 0;
+	int64_t mtime = 0;
+	bool stale = false; // rebuild is scheduled, but not performed yet
 	Vector<Node> nodes;
-	Vector<Pair<String, size_t>> tags;
+	std::unordered_map<int64_t, uint32_t> slots; // id -> index in nodes, for built spine
+	Vector<Pair<String, size_t>> tags; // sorted by tag, with number of tagged pages
+	Vector<Bytes> tagPages; // delta-encoded ids of tagged pages, for built spine
 
 	const db::Scheme *units = nullptr;
 	const db::Scheme *sections = nullptr;
 	const db::Scheme *pages = nullptr;
 	db::Transaction storage = nullptr;
-};
 
-class HyphenMap : public SharedObject {
-public:
-	void addHyphenDict(CharGroupId id, const String &file);
-	Vector<uint8_t> makeWordHyphens(const char16_t *ptr, size_t len);
-	Vector<uint8_t> makeWordHyphens(const WideStringView &);
-	void purgeHyphenDicts();
-
-	void hyphenateWord(std::ostream &, const StringViewUtf8 & wordReader);
-
-	HyphenMap(mem::pool_t *p) : SharedObject(p) { }
-	virtual ~HyphenMap() { }
-
-protected:
-	String convertWord(HyphenDict *, const char16_t *ptr, size_t len);
-
-	Map<CharGroupId, HyphenDict *> _dicts;
+	std::shared_ptr<const WikiComponent::CachedSpine> stored; // owns binary data
+	Columns columns;
+	mutable Map<int64_t, Node> decoded;
 };
 
-data::Value processMarkdown(mem::pool_t *pool, const StringView & source, const data::Value &cache);
+data::Value processMarkdown(mem::pool_t *pool, const StringView & source);
+
+// extracts meta, calls full-text callback for every block and (optionally) writes hyphenated html within single parse
+data::Value processMarkdown(mem::pool_t *pool, const StringView & source,
+		const Callback<void(const StringView &, search::Language)> *split, std::ostream *html = nullptr, const Rc<HyphenMap> & = nullptr,
+		languages::Language = languages::Language::Unknown);
 
 void writeHtml(std::ostream *, mem::pool_t *, const StringView & source,
 		const stappler::mmd::Extensions &ext = stappler::mmd::DefaultExtensions);
 void writeHtmlHyph(std::ostream *, mem::pool_t *, const StringView & source, const Rc<HyphenMap> &,
-		const stappler::mmd::Extensions &ext = stappler::mmd::DefaultExtensions, const data::Value &meta = data::Value());
+		const stappler::mmd::Extensions &ext = stappler::mmd::DefaultExtensions, const data::Value &meta = data::Value(),
+		languages::Language = languages::Language::Unknown);
+
+static constexpr size_t HtmlChunkSize = 16_KiB;
+static constexpr size_t HtmlHeadChunkSize = 2_KiB;
+
+// streams rendered html into target (usually, Request) with bounded buffering; every chunk is flushed to client,
+// first chunk is smaller to lower time-to-first-byte
+void writeHtmlHyphChunked(std::ostream &, mem::pool_t *, const StringView & source, const Rc<HyphenMap> &,
+		size_t chunkSize = HtmlChunkSize, const stappler::mmd::Extensions &ext = stappler::mmd::StapplerExtensions,
+		const data::Value &meta = data::Value(), languages::Language = languages::Language::Unknown);
 
 void splitTextForStemmer(mem::pool_t *pool, const StringView &content, const Callback<void(const StringView &)> &);
+void splitTextForFullText(mem::pool_t *pool, const StringView &content, const Callback<void(const StringView &, search::Language)> &);
 
 void splitTextForHighlight(mem::pool_t *pool, const StringView &content, const Callback<bool(const StringView &, const StringView &)> &);
 
+static constexpr size_t SearchSnippetsCount = 3;
+
+// snippets for search result: [{ index: <block id>, hash: <block mark>, text: <html with matches in <mark>> }];
+// no more snippets are made, when maxSnippets are found or time budget is exceeded,
+// but document is still parsed to the end, only text extraction is skipped for the rest
+data::Value makeSearchSnippets(mem::pool_t *pool, const StringView &source, const data::Value &meta, const StringView &query,
+		size_t maxSnippets = SearchSnippetsCount, TimeInterval budget = TimeInterval::milliseconds(20));
+
 NS_SA_EXT_END(lore)
 
 #endif /* SRC_WIKI_LOREWIKI_H_ */
@@ -29,8 +29,72 @@ THE SOFTWARE.
 
 #include "hyphen.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 NS_SA_EXT_BEGIN(lore)
 
+// tags, significant for Lore output processors, dispatched by name length, then by characters
+enum class HtmlTag : uint8_t {
+	Other,
+	H1, H2, H3, H4, H5, H6,
+	P,
+	Li,
+	Pre,
+	A,
+};
+
+static inline HtmlTag HtmlTag_get(const StringView &name) {
+	switch (name.size()) {
+	case 1:
+		switch (name[0]) {
+		case 'p': return HtmlTag::P;
+		case 'a': return HtmlTag::A;
+		default: break;
+		}
+		break;
+	case 2:
+		if (name[0] == 'h' && name[1] >= '1' && name[1] <= '6') {
+			return HtmlTag(toInt(HtmlTag::H1) + (name[1] - '1'));
+		} else if (name[0] == 'l' && name[1] == 'i') {
+			return HtmlTag::Li;
+		}
+		break;
+	case 3:
+		if (name[0] == 'p' && name[1] == 'r' && name[2] == 'e') {
+			return HtmlTag::Pre;
+		}
+		break;
+	default:
+		break;
+	}
+	return HtmlTag::Other;
+}
+
+// block tags are annotated with mark hash and index, and used as units for text splitting
+static inline bool HtmlTag_isBlock(HtmlTag tag) {
+	return tag >= HtmlTag::H1 && tag <= HtmlTag::Pre;
+}
+
+enum class HtmlAttr : uint8_t {
+	Other,
+	Href,
+	Type,
+};
+
+static inline HtmlAttr HtmlAttr_get(const StringView &name) {
+	if (name.size() == 4) {
+		switch (name[0]) {
+		case 'h': if (name[1] == 'r' && name[2] == 'e' && name[3] == 'f') { return HtmlAttr::Href; } break;
+		case 't': if (name[1] == 'y' && name[2] == 'p' && name[3] == 'e') { return HtmlAttr::Type; } break;
+		default: break;
+		}
+	}
+	return HtmlAttr::Other;
+}
+
 class HtmlHyphOutputProcessor : public stappler::mmd::HtmlOutputProcessor {
 public:
 	using Engine = stappler::mmd::Engine;
@@ -40,25 +104,28 @@ public:
 	using Extensions = stappler::mmd::Extensions;
 
 	static void run(std::ostream *stream, mem::pool_t *pool, const StringView &str, const Rc<HyphenMap> &dict,
-			const Extensions &ext = stappler::mmd::DefaultExtensions, const data::Value *meta = nullptr) {
+			const Extensions &ext = stappler::mmd::DefaultExtensions, const data::Value *meta = nullptr,
+			languages::Language lang = languages::Language::Unknown) {
 		Engine e; e.init(pool, str, ext);
 		e.setQuotesLanguage(stappler::mmd::QuotesLanguage::Russian);
 
 		e.process([&] (const Content &c, const StringView &s, const Token &t) {
-			HtmlHyphOutputProcessor p; p.init(stream, dict, meta);
+			HtmlHyphOutputProcessor p; p.init(stream, dict, meta, lang);
 			p.process(c, s, t);
 		});
 	}
 
 	virtual ~HtmlHyphOutputProcessor() { }
 
-	virtual bool init(std::ostream *stream, const Rc<HyphenMap> &dict, const data::Value *meta) {
+	virtual bool init(std::ostream *stream, const Rc<HyphenMap> &dict, const data::Value *meta,
+			languages::Language lang = languages::Language::Unknown) {
 		if (!HtmlOutputProcessor::init(stream)) {
 			return false;
 		}
 
 		_dictMap = dict;
 		_meta = meta;
+		_language = lang;
 		html_header_level = 4;
 		safeMath = true;
 		return true;
@@ -66,8 +133,7 @@ public:
 
 protected:
 	virtual void pushNode(token *t, const StringView &name, InitList &&attr, VecList && vec) override {
-		if (_meta && t && (name == "h1" || name == "h2" || name == "h3" || name == "h4" || name == "h5" || name == "h6" ||
-				name == "p" || name == "li" || name == "pre")) {
+		if (_meta && t && HtmlTag_isBlock(HtmlTag_get(name))) {
 			auto &marks = _meta->getValue("marks");
 			if (marks && marks.isDictionary()) {
 				auto key = toString(_nextObjectId);
@@ -89,7 +155,7 @@ protected:
 
 	void hyphenateWord(const StringViewUtf8 & wordReader) {
 		if (_dictMap) {
-			_dictMap->hyphenateWord(*output, wordReader);
+			_dictMap->hyphenateWord(*output, wordReader, _language);
 		}
 	}
 
@@ -107,7 +173,7 @@ protected:
 			auto wordReader = bufContents.readChars<GroupChar>();
 			while (!wordReader.empty()) {
 				if (wordReader.size() > 3) {
-					_dictMap->hyphenateWord(*output, wordReader);
+					_dictMap->hyphenateWord(*output, wordReader, _language);
 				} else {
 					*output << wordReader;
 				}
@@ -121,88 +187,113 @@ protected:
 	size_t _nextObjectId = 1;
 	const data::Value *_meta = nullptr;
 	Rc<HyphenMap> _dictMap = nullptr;
+	languages::Language _language = languages::Language::Unknown;
 };
 
 
-class MetaExtractor : public stappler::mmd::HtmlOutputProcessor {
+// bounded output buffer, that passes html into target stream by chunks and flushes every chunk,
+// so large documents are streamed to client instead of being accumulated before response
+class HtmlChunkedBuffer : public std::streambuf {
 public:
-	using Engine = stappler::mmd::Engine;
-	using Content = stappler::mmd::Content;
-	using Token = stappler::mmd::Token;
-	using token = stappler::mmd::token;
-	using Extensions = stappler::mmd::Extensions;
+	HtmlChunkedBuffer(std::ostream &target, size_t chunkSize, size_t headSize)
+	: _target(target), _chunkSize(chunkSize) {
+		_data.resize(max(chunkSize, headSize));
+		setp(_data.data(), _data.data() + min(headSize, _data.size()));
+	}
 
-	static void run(data::Value *val, mem::pool_t *pool, const StringView &str, Extensions ext = stappler::mmd::StapplerExtensions) {
-		Engine e; e.init(pool, str, ext);
-		e.setQuotesLanguage(stappler::mmd::QuotesLanguage::Russian);
+	virtual ~HtmlChunkedBuffer() {
+		flushChunk();
+	}
 
-		e.process([&] (const Content &c, const StringView &s, const Token &t) {
-			MetaExtractor p; p.init(val, pool);
-			p.extractBrief(s);
-			p.process(c, s, t);
-		});
+protected:
+	virtual int_type overflow(int_type c) override {
+		flushChunk();
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
 	}
 
-	static void run(const Callback<void(const StringView &)> &cb, mem::pool_t *pool, const StringView &str, Extensions ext = stappler::mmd::StapplerExtensions) {
-		Engine e; e.init(pool, str, ext);
-		e.setQuotesLanguage(stappler::mmd::QuotesLanguage::Russian);
+	virtual std::streamsize xsputn(const char *s, std::streamsize n) override {
+		std::streamsize written = 0;
+		while (written < n) {
+			auto space = epptr() - pptr();
+			if (space == 0) {
+				flushChunk();
+				continue;
+			}
 
-		e.process([&] (const Content &c, const StringView &s, const Token &t) {
-			MetaExtractor p; p.init(cb, pool);
-			p.process(c, s, t);
-		});
+			auto len = std::min(std::streamsize(space), n - written);
+			memcpy(pptr(), s + written, len);
+			pbump(int(len));
+			written += len;
+		}
+		return written;
 	}
 
-	static void run(const Callback<bool(const StringView &, const StringView &)> &cb,
-			mem::pool_t *pool, const StringView &str, Extensions ext = stappler::mmd::StapplerExtensions) {
+	virtual int sync() override {
+		flushChunk();
+		return 0;
+	}
+
+	void flushChunk() {
+		if (pptr() != pbase()) {
+			_target.write(pbase(), pptr() - pbase());
+			_target.flush();
+		}
+		// first (head) chunk can be smaller, then chunks use full size
+		setp(_data.data(), _data.data() + min(_chunkSize, _data.size()));
+	}
+
+	std::ostream &_target;
+	size_t _chunkSize;
+	Vector<char> _data;
+};
+
+
+class MarkdownProcessor : public HtmlHyphOutputProcessor {
+public:
+	struct Target {
+		data::Value *meta = nullptr; // brief, headers, links, inserts and block marks
+		const Callback<void(const StringView &)> *split = nullptr; // per-block, per-language stemmer chunks
+		const Callback<void(const StringView &, search::Language)> *splitLang = nullptr; // same chunks with its language
+		const Callback<bool(const StringView &, const StringView &)> *headline = nullptr; // per-block plain text with block id
+		std::ostream *html = nullptr; // hyphenated html with block marks
+		Rc<HyphenMap> hyph;
+		languages::Language language = languages::Language::Unknown;
+	};
+
+	static void run(const Target &target, mem::pool_t *pool, const StringView &str, Extensions ext = stappler::mmd::StapplerExtensions) {
 		Engine e; e.init(pool, str, ext);
 		e.setQuotesLanguage(stappler::mmd::QuotesLanguage::Russian);
 
 		e.process([&] (const Content &c, const StringView &s, const Token &t) {
-			MetaExtractor p; p.init(cb, pool);
+			MarkdownProcessor p; p.init(target, pool);
+			if (target.meta) {
+				p.extractBrief(s);
+			}
 			p.process(c, s, t);
 		});
 	}
 
-	virtual ~MetaExtractor() { }
+	virtual ~MarkdownProcessor() { }
 
-	virtual bool init(data::Value *val, mem::pool_t *pool) {
-		if (!HtmlOutputProcessor::init(&_bufferStream)) {
+	virtual bool init(const Target &target, mem::pool_t *pool) {
+		if (!HtmlHyphOutputProcessor::init(target.html ? target.html : &_bufferStream, target.html ? target.hyph : Rc<HyphenMap>(), nullptr, target.language)) {
 			return false;
 		}
-		_value = val;
-		_pool = pool;
-		safeMath = true;
-		return true;
-	}
-
-	virtual bool init(const Callback<void(const StringView &)> &cb, mem::pool_t *pool) {
-		if (!HtmlOutputProcessor::init(&_bufferStream)) {
-			return false;
-		}
-		_splitCallback = &cb;
-		_pool = pool;
-		safeMath = true;
-		return true;
-	}
-
-	virtual bool init(const Callback<bool(const StringView &, const StringView &)> &cb, mem::pool_t *pool) {
-		if (!HtmlOutputProcessor::init(&_bufferStream)) {
-			return false;
-		}
-		_headlineCallback = &cb;
+		_value = target.meta;
+		_splitCallback = target.split;
+		_splitLangCallback = target.splitLang;
+		_headlineCallback = target.headline;
+		_html = (target.html != nullptr);
 		_pool = pool;
 		safeMath = true;
 		return true;
 	}
 
 protected:
-	struct ContentRecord {
-		String label;
-		String href;
-		Vector<ContentRecord> childs;
-	};
-
 	void extractBrief(const StringView &s) {
 		StringView r(s);
 		r.skipChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
@@ -221,169 +312,236 @@ protected:
 		}
 	}
 
-	void pushNode(token *t, const StringView &name, InitList &&attr, VecList && vec) override {
-		flushBuffer();
-
-		if (!_value && _splitCallback) {
-			if (t && (name == "h1" || name == "h2" || name == "h3" || name == "h4" || name == "h5" || name == "h6" ||
-					name == "p" || name == "li" || name == "pre")) {
-
-				Map<search::Language, StringStream> langs;
+	void extractLink(const InitList &attr, const VecList &vec) {
+		bool isInsert = false;
+		StringView href;
+		auto readAttr = [&] (const StringView &name, const StringView &value) {
+			switch (HtmlAttr_get(name)) {
+			case HtmlAttr::Href: if (!value.is('#')) { href = value; } break;
+			case HtmlAttr::Type: if (value == "insert") { isInsert = true; } break;
+			default: break;
+			}
+		};
 
-				Token tok(t->child);
-				makeTokenTreeHash([&] (const StringView &str) {
-					StringViewUtf8 r(str);
+		for (auto &it : vec) {
+			readAttr(it.first, it.second);
+		}
+		if (href.empty()) {
+			for (auto &it : attr) {
+				readAttr(it.first, it.second);
+			}
+		}
+		if (!href.empty()) {
+			mem::pool::push(_pool);
+			if (isInsert) {
+				_value->emplace("inserts").addString(href.str());
+			} else {
+				_value->emplace("links").addString(href.str());
+			}
+			mem::pool::pop();
+		}
+	}
 
-					r.trimChars<StringViewUtf8::MatchCharGroup<CharGroupId::WhiteSpace>>();
-					r.split<StringViewUtf8::MatchCharGroup<CharGroupId::WhiteSpace>>([&] (const StringViewUtf8 &iword) {
-						StringViewUtf8 word(iword);
-						word.trimUntil<
-							StringViewUtf8::MatchCharGroup<CharGroupId::Alphanumeric>,
-							StringViewUtf8::MatchCharGroup<CharGroupId::Cyrillic>>();
-						auto lang = search::detectLanguage(StringView(word.data(), word.size()));
+	void writeHashChunk(const StringView &str) {
+		StackBuffer<1_KiB> tmpBuf;
 
-						StringStream *target = nullptr;
-						auto it = langs.find(lang);
-						if (it == langs.end()) {
-							target = &langs.emplace(lang, StringStream()).first->second;
-						} else {
-							target = &it->second;
-						}
+		StringViewUtf8 r(str);
+		while (!r.empty()) {
+			auto tmp = r.readChars<StringViewUtf8::MatchCharGroup<CharGroupId::Alphanumeric>,
+					StringViewUtf8::MatchCharGroup<CharGroupId::Cyrillic>>();
+
+			tmpBuf.clear();
+			if (tmp.size() < 1_KiB) {
+				tmpBuf.put((const uint8_t *)tmp.data(), tmp.size());
+				string::tolower_buf((char *)tmpBuf.data(), tmpBuf.size());
+				_buffer.put(tmpBuf.data(), tmpBuf.size());
+			}
 
-						if (target->empty()) { (*target) << word; } else { (*target) << " " << word; }
-					});
-				}, t->child);
+			r.skipUntil<StringViewUtf8::MatchCharGroup<CharGroupId::Alphanumeric>,
+					StringViewUtf8::MatchCharGroup<CharGroupId::Cyrillic>>();
+		}
+	}
 
-				mem::pool::push(_pool);
-				for (auto &it : langs) {
-					if (!it.second.empty()) {
-						(*_splitCallback)(it.second.weak());
-					}
-				}
-				mem::pool::pop();
+	String &getSplitBuffer(search::Language lang) {
+		for (size_t i = 0; i < _splitCount; ++ i) {
+			if (_split[i].first == lang) {
+				return _split[i].second;
 			}
-			return;
 		}
 
-		if (!_value && _headlineCallback) {
-			if (!_headlineEnabled) {
+		// slots are kept between blocks to reuse their buffers, new one is added, when block has more languages than any before
+		if (_splitCount == _split.size()) {
+			_split.emplace_back();
+		}
+
+		auto &slot = _split[_splitCount ++];
+		slot.first = lang;
+		slot.second.clear();
+		return slot.second;
+	}
+
+	void writeSplitChunk(const StringView &str) {
+		StringViewUtf8 r(str);
+
+		r.trimChars<StringViewUtf8::MatchCharGroup<CharGroupId::WhiteSpace>>();
+		r.split<StringViewUtf8::MatchCharGroup<CharGroupId::WhiteSpace>>([&] (const StringViewUtf8 &iword) {
+			StringViewUtf8 word(iword);
+			word.trimUntil<
+				StringViewUtf8::MatchCharGroup<CharGroupId::Alphanumeric>,
+				StringViewUtf8::MatchCharGroup<CharGroupId::Cyrillic>>();
+			if (word.empty()) {
 				return;
 			}
 
-			if (t && (name == "h1" || name == "h2" || name == "h3" || name == "h4" || name == "h5" || name == "h6" ||
-					name == "p" || name == "li" || name == "pre")) {
+			// language is detected once per run of words in the same script
+			auto script = HyphenMap::getScript(StringViewUtf8(word).readChar());
+			search::Language lang;
+			if (script != HyphenMap::Script::Unknown && script == _splitScript) {
+				lang = _splitLanguage;
+			} else {
+				lang = search::detectLanguage(StringView(word.data(), word.size()));
+				_splitScript = script;
+				_splitLanguage = lang;
+			}
 
-				StringStream tmp;
+			auto &target = getSplitBuffer(lang);
+			if (!target.empty()) {
+				target.push_back(' ');
+			}
+			target.append(word.data(), word.size());
+		});
+	}
 
-				Token tok(t->child);
-				makeTokenTreeHash([&] (const StringView &str) {
-					tmp << str;
-				}, t->child);
+	// single traversal of block content for all enabled targets
+	void processBlock(token *t) {
+		const bool hashEnabled = _value || _html;
+		const bool splitEnabled = (_splitCallback != nullptr || _splitLangCallback != nullptr);
+		const bool headlineEnabled = (_headlineCallback != nullptr) && _headlineEnabled;
 
-				if (!tmp.empty()) {
-					mem::pool::push(_pool);
-					if (!(*_headlineCallback)(tmp.weak(), toString(_nextObjectId))) {
-						_headlineEnabled = false;
-					}
-					mem::pool::pop();
-				}
+		_mark.clear();
+		_markIndex.clear();
 
-				tmp.clear();
-				++ _nextObjectId;
-			}
+		if (!hashEnabled && !splitEnabled && !headlineEnabled) {
 			return;
 		}
 
-		if (name == "a") {
-			bool isInsert = false;
-			StringView href;
-			for (auto &it : vec) {
-				if (it.first == "href" && !it.second.is('#')) {
-					href = it.second;
-				}
-				if (it.first == "type" && it.second == "insert") {
-					isInsert = true;
-				}
+		_splitCount = 0;
+		_splitScript = HyphenMap::Script::Unknown;
+		StringStream headline;
+
+		_buffer.clear();
+		makeTokenTreeHash([&] (const StringView &str) {
+			if (hashEnabled) {
+				writeHashChunk(str);
 			}
-			if (href.empty()) {
-				for (auto &it : attr) {
-					if (it.first == "href" && !it.second.is('#')) {
-						href = it.second;
-					}
-					if (it.first == "type" && it.second == "insert") {
-						isInsert = true;
-					}
-				}
+			if (splitEnabled) {
+				writeSplitChunk(str);
 			}
-			if (!href.empty()) {
-				mem::pool::push(_pool);
-				if (isInsert) {
-					_value->emplace("inserts").addString(href.str());
-				} else {
-					_value->emplace("links").addString(href.str());
+			if (headlineEnabled) {
+				headline << str;
+			}
+		}, t->child);
+
+		mem::pool::push(_pool);
+		if (hashEnabled && !_buffer.empty()) {
+			auto h = hash::hash64((const char *)_buffer.data(), _buffer.size());
+			_mark = base64url::encode(CoderSource((const uint8_t *)&h, sizeof(h)));
+			_markIndex = toString(_nextObjectId);
+			if (_value) {
+				auto &m = (_value->hasValue("marks")?_value->getValue("marks"):_value->emplace("marks"));
+				m.setString(_mark, _markIndex);
+			}
+		}
+
+		if (splitEnabled) {
+			for (size_t i = 0; i < _splitCount; ++ i) {
+				if (!_split[i].second.empty()) {
+					if (_splitLangCallback) {
+						(*_splitLangCallback)(_split[i].second, _split[i].first);
+					} else {
+						(*_splitCallback)(_split[i].second);
+					}
 				}
-				mem::pool::pop();
 			}
 		}
 
-		if (t && (name == "h1" || name == "h2" || name == "h3" || name == "h4" || name == "h5" || name == "h6" ||
-				name == "p" || name == "li" || name == "pre")) {
-			_buffer.clear();
+		if (headlineEnabled && !headline.empty()) {
+			if (!(*_headlineCallback)(headline.weak(), toString(_nextObjectId))) {
+				_headlineEnabled = false;
+			}
+		}
+		mem::pool::pop();
+	}
 
-			Token tok(t->child);
-			makeTokenTreeHash([&] (const StringView &str) {
-				StackBuffer<1_KiB> tmpBuf;
+	virtual void pushNode(token *t, const StringView &name, InitList &&attr, VecList && vec) override {
+		if (!_html) {
+			flushBuffer();
+		}
 
-				StringViewUtf8 r(str);
-				while (!r.empty()) {
-					auto tmp = r.readChars<StringViewUtf8::MatchCharGroup<CharGroupId::Alphanumeric>,
-							StringViewUtf8::MatchCharGroup<CharGroupId::Cyrillic>>();
+		auto tag = HtmlTag_get(name);
+		if (_value && tag == HtmlTag::A) {
+			extractLink(attr, vec);
+		}
 
-					tmpBuf.clear();
-					if (tmp.size() < 1_KiB) {
-						tmpBuf.put((const uint8_t *)tmp.data(), tmp.size());
-						string::tolower_buf((char *)tmpBuf.data(), tmpBuf.size());
-						_buffer.put(tmpBuf.data(), tmpBuf.size());
-					}
+		const bool isBlock = t && HtmlTag_isBlock(tag);
 
-					r.skipUntil<StringViewUtf8::MatchCharGroup<CharGroupId::Alphanumeric>,
-							StringViewUtf8::MatchCharGroup<CharGroupId::Cyrillic>>();
-				}
-			}, t->child);
+		if (isBlock) {
+			processBlock(t);
+		}
 
-			if (!_buffer.empty()) {
-				mem::pool::push(_pool);
-				auto &m = (_value->hasValue("marks")?_value->getValue("marks"):_value->emplace("marks"));
-				auto h = hash::hash64((const char *)_buffer.data(), _buffer.size());
-				m.setString(base64url::encode(CoderSource((const uint8_t *)&h, sizeof(h))), toString(_nextObjectId));
-				mem::pool::pop();
+		if (_html) {
+			if (isBlock && !_mark.empty()) {
+				VecList nvec(move(vec));
+				nvec.emplace_back("data-hash", _mark);
+				nvec.emplace_back("data-index", _markIndex);
+				HtmlOutputProcessor::pushNode(t, name, move(attr), move(nvec));
+			} else {
+				HtmlOutputProcessor::pushNode(t, name, move(attr), move(vec));
 			}
+		} else if (_value) {
+			tagStack.emplace_back(name, 0);
+		}
 
+		if (isBlock) {
 			++ _nextObjectId;
 		}
-
-		tagStack.emplace_back(name, 0);
 	}
 
-	void pushInlineNode(token *t, const StringView &name, InitList &&attr, VecList && vec) override {
-		flushBuffer();
+	virtual void pushInlineNode(token *t, const StringView &name, InitList &&attr, VecList && vec) override {
+		if (_html) {
+			HtmlOutputProcessor::pushInlineNode(t, name, move(attr), move(vec));
+		} else {
+			flushBuffer();
+		}
 	}
 
-	void popNode() override {
-		flushBuffer();
-		if (_value) {
-			tagStack.pop_back();
+	virtual void popNode() override {
+		if (_html) {
+			HtmlOutputProcessor::popNode();
+		} else {
+			flushBuffer();
+			if (_value) {
+				tagStack.pop_back();
+			}
 		}
 	}
 
 	virtual void flushBuffer() override {
-		buffer.clear();
+		if (_html) {
+			HtmlHyphOutputProcessor::flushBuffer();
+		} else {
+			buffer.clear();
+		}
 	}
 
 	virtual void processHtml(const Content &c, const StringView &str, const Token &t) override {
-		source = str;
-		exportTokenTree(buffer, t);
-		flushBuffer();
+		if (_html) {
+			HtmlOutputProcessor::processHtml(c, str, t);
+		} else {
+			source = str;
+			exportTokenTree(buffer, t);
+			flushBuffer();
+		}
 
 		if (!_value) {
 			return;
@@ -394,6 +552,12 @@ protected:
 			return;
 		}
 
+		// header labels are exported in meta-only mode, so nothing from them leaks into html output
+		auto html = _html;
+		auto out = output;
+		_html = false;
+		output = &_bufferStream;
+
 		mem::pool::push(_pool);
 
 		uint8_t level = 0;
@@ -417,23 +581,47 @@ protected:
 		}
 
 		mem::pool::pop();
+
+		buffer.clear();
+		output = out;
+		_html = html;
 	}
 
-	size_t _nextObjectId = 1;
-	ContentRecord _contentsRoot;
 	StringStream _bufferStream;
 	data::Value *_value = nullptr;
 	mem::pool_t *_pool = nullptr;
 	Buffer _buffer;
-	const Callback<void(const StringView &)> *_splitCallback;
+	String _mark;
+	String _markIndex;
+	bool _html = false;
+
+	const Callback<void(const StringView &)> *_splitCallback = nullptr;
+	const Callback<void(const StringView &, search::Language)> *_splitLangCallback = nullptr;
+
+	// per-language word buffers, reused between blocks
+	Vector<Pair<search::Language, String>> _split;
+	size_t _splitCount = 0;
+	HyphenMap::Script _splitScript = HyphenMap::Script::Unknown;
+	search::Language _splitLanguage = search::Language();
 
 	bool _headlineEnabled = true;
-	const Callback<bool(const StringView &, const StringView &)> *_headlineCallback;
+	const Callback<bool(const StringView &, const StringView &)> *_headlineCallback = nullptr;
 };
 
-data::Value processMarkdown(mem::pool_t *pool, const StringView & source, const data::Value &cache) {
+data::Value processMarkdown(mem::pool_t *pool, const StringView & source) {
+	return processMarkdown(pool, source, nullptr);
+}
+
+data::Value processMarkdown(mem::pool_t *pool, const StringView & source,
+		const Callback<void(const StringView &, search::Language)> *split, std::ostream *html, const Rc<HyphenMap> &hyph, languages::Language lang) {
 	data::Value data;
-	MetaExtractor::run(&data, pool, source);
+	MarkdownProcessor::Target target;
+	target.meta = &data;
+	target.splitLang = split;
+	target.html = html;
+	target.hyph = hyph;
+	target.language = lang;
+	MarkdownProcessor::run(target, pool, source);
 	return data;
 }
 
@@ -443,137 +631,855 @@ void writeHtml(std::ostream *stream, mem::pool_t *pool, const StringView & sourc
 }
 
 void writeHtmlHyph(std::ostream *stream, mem::pool_t *pool, const StringView & source, const Rc<HyphenMap> &dict,
-		const stappler::mmd::Extensions &ext, const data::Value &meta) {
-	HtmlHyphOutputProcessor::run(stream, pool, source, dict, ext, meta ? &meta : nullptr);
+		const stappler::mmd::Extensions &ext, const data::Value &meta, languages::Language lang) {
+	HtmlHyphOutputProcessor::run(stream, pool, source, dict, ext, meta ? &meta : nullptr, lang);
+}
+
+void writeHtmlHyphChunked(std::ostream &target, mem::pool_t *pool, const StringView & source, const Rc<HyphenMap> &dict,
+		size_t chunkSize, const stappler::mmd::Extensions &ext, const data::Value &meta, languages::Language lang) {
+	HtmlChunkedBuffer buf(target, chunkSize, min(chunkSize, size_t(HtmlHeadChunkSize)));
+	std::ostream stream(&buf);
+	HtmlHyphOutputProcessor::run(&stream, pool, source, dict, ext, meta ? &meta : nullptr, lang);
+	stream.flush();
 }
 
 void splitTextForStemmer(mem::pool_t *pool, const StringView &content, const Callback<void(const StringView &)> &cb) {
-	MetaExtractor::run(cb, pool, content);
+	MarkdownProcessor::Target target;
+	target.split = &cb;
+	MarkdownProcessor::run(target, pool, content);
+}
+
+void splitTextForFullText(mem::pool_t *pool, const StringView &content, const Callback<void(const StringView &, search::Language)> &cb) {
+	MarkdownProcessor::Target target;
+	target.splitLang = &cb;
+	MarkdownProcessor::run(target, pool, content);
 }
 
 void splitTextForHighlight(mem::pool_t *pool, const StringView &content, const Callback<bool(const StringView &, const StringView &)> &cb) {
-	MetaExtractor::run(cb, pool, content);
+	MarkdownProcessor::Target target;
+	target.headline = &cb;
+	MarkdownProcessor::run(target, pool, content);
 }
 
-void HyphenMap::addHyphenDict(CharGroupId id, const String &file) {
-	auto data = filesystem::readTextFile(file);
-	if (!data.empty()) {
-		auto dict = hnj_hyphen_load_data(data.data(), data.size());
-		if (dict) {
-			auto it = _dicts.find(id);
-			if (it == _dicts.end()) {
-				_dicts.emplace(id, dict);
+static constexpr size_t SearchSnippetLeading = 64;
+static constexpr size_t SearchSnippetLength = 240;
+
+using SearchSnippetWordChars = StringViewUtf8::MatchCompose<
+		StringViewUtf8::MatchCharGroup<CharGroupId::Alphanumeric>,
+		StringViewUtf8::MatchCharGroup<CharGroupId::Cyrillic>>;
+
+static String SearchSnippet_normalize(const StringView &word) {
+	String ret(word.data(), word.size());
+	string::tolower_buf(ret.data(), ret.size());
+	return ret;
+}
+
+// words are stemmed with the same stemmer, that builds "ts" vector for the word language
+static String SearchSnippet_stem(const StringView &word) {
+	auto str = SearchSnippet_normalize(word);
+	if (auto env = search::getStemmer(search::detectLanguage(str))) {
+		auto stem = search::stemWord(str, env);
+		if (!stem.empty()) {
+			return stem.str();
+		}
+	}
+	return str;
+}
+
+static bool SearchSnippet_match(const StringView &word, const Vector<String> &stems) {
+	auto str = SearchSnippet_stem(word);
+	for (auto &it : stems) {
+		if (str == it) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void SearchSnippet_escape(StringStream &out, const StringView &str) {
+	for (size_t i = 0; i < str.size(); ++ i) {
+		auto c = str[i];
+		switch (c) {
+		case '<': out << "&lt;"; break;
+		case '>': out << "&gt;"; break;
+		case '&': out << "&amp;"; break;
+		case '"': out << "&quot;"; break;
+		default: out << c; break;
+		}
+	}
+}
+
+// returns html-escaped fragment around first match, with matched words in <mark>, or empty string if nothing matched
+static String SearchSnippet_make(const StringView &text, const Vector<String> &stems) {
+	struct Piece {
+		StringView text;
+		bool match;
+	};
+
+	Vector<Piece> pieces;
+	size_t first = maxOf<size_t>();
+
+	StringViewUtf8 r(text);
+	while (!r.empty()) {
+		auto sep = r.readUntil<SearchSnippetWordChars>();
+		if (!sep.empty()) {
+			pieces.emplace_back(Piece{StringView(sep.data(), sep.size()), false});
+		}
+		auto word = r.readChars<SearchSnippetWordChars>();
+		if (!word.empty()) {
+			auto w = StringView(word.data(), word.size());
+			auto m = SearchSnippet_match(w, stems);
+			if (m && first == maxOf<size_t>()) {
+				first = size_t(w.data() - text.data());
+			}
+			pieces.emplace_back(Piece{w, m});
+		}
+	}
+
+	if (first == maxOf<size_t>()) {
+		return String();
+	}
+
+	auto start = (first > SearchSnippetLeading) ? first - SearchSnippetLeading : 0;
+	auto end = start + SearchSnippetLength;
+
+	StringStream out;
+	if (start > 0) {
+		out << "…";
+	}
+	for (auto &it : pieces) {
+		auto offset = size_t(it.text.data() - text.data());
+		if (offset + it.text.size() <= start) {
+			continue;
+		} else if (offset >= end) {
+			out << "…";
+			break;
+		}
+
+		if (it.match) {
+			out << "<mark>";
+			SearchSnippet_escape(out, it.text);
+			out << "</mark>";
+		} else {
+			SearchSnippet_escape(out, it.text);
+		}
+	}
+	return out.str();
+}
+
+data::Value makeSearchSnippets(mem::pool_t *pool, const StringView &source, const data::Value &meta, const StringView &query,
+		size_t maxSnippets, TimeInterval budget) {
+	Vector<String> stems;
+	StringViewUtf8 q(query);
+	while (!q.empty()) {
+		q.skipUntil<SearchSnippetWordChars>();
+		auto word = q.readChars<SearchSnippetWordChars>();
+		if (!word.empty()) {
+			stems.emplace_back(SearchSnippet_stem(StringView(word.data(), word.size())));
+		}
+	}
+
+	if (stems.empty() || maxSnippets == 0) {
+		return data::Value();
+	}
+
+	auto deadline = Time::now() + budget;
+	auto &marks = meta.getValue("marks");
+
+	data::Value ret;
+	splitTextForHighlight(pool, source, [&] (const StringView &text, const StringView &index) -> bool {
+		auto snippet = SearchSnippet_make(text, stems);
+		if (!snippet.empty()) {
+			auto &v = ret.addValue(data::Value({
+				pair("index", data::Value(index)),
+				pair("text", data::Value(move(snippet))),
+			}));
+			if (marks.isString(index)) {
+				v.setString(marks.getString(index), "hash");
+			}
+		}
+
+		// no more blocks are passed to us, when we have enough snippets or out of time
+		return ret.size() < maxSnippets && Time::now() < deadline;
+	});
+	return ret;
+}
+
+static HyphenMap::Charset HyphenMap_getCharset(const StringView &cset) {
+	if (cset == "UTF-8") {
+		return HyphenMap::Charset::Utf8;
+	} else if (cset == "KOI8-R") {
+		return HyphenMap::Charset::Koi8r;
+	} else if (cset == "ISO8859-1" || cset == "ISO-8859-1") {
+		return HyphenMap::Charset::Latin1;
+	}
+	return HyphenMap::Charset::Unknown;
+}
+
+// Compiled dictionary layout: header, uint32 columns (edge ranges for nodes + 1, value offsets for nodes,
+// edge targets), then uint8 columns (edge chars, sorted within node, and values). Values of pattern node
+// are stored as [count, value...] and indexed by bytes of encoded word, so UTF-8 dictionaries need no decoding
+struct HyphenMap::Binary {
+	static constexpr uint32_t Magic = 0x4259484C; // "LHYB"
+	static constexpr uint16_t Version = 1;
+
+	struct Header {
+		uint32_t magic;
+		uint16_t version;
+		uint8_t charset;
+		uint8_t lhmin;
+		uint8_t rhmin;
+		uint8_t reserved[3];
+		uint32_t nodes;
+		uint32_t edges;
+		uint32_t values;
+	};
+
+	static constexpr uint32_t InvalidNode = maxOf<uint32_t>();
+
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+
+	const Header *header = nullptr;
+	const uint32_t *edgeRanges = nullptr;
+	const uint32_t *nodeValues = nullptr; // offset + 1 in values, or 0
+	const uint32_t *edgeTargets = nullptr;
+	const uint8_t *edgeChars = nullptr;
+	const uint8_t *values = nullptr;
+
+	bool init(const uint8_t *d, size_t s) {
+		if (s < sizeof(Header)) {
+			return false;
+		}
+
+		auto h = (const Header *)d;
+		if (h->magic != Magic || h->version != Version || h->nodes == 0
+				|| h->charset == toInt(Charset::Unknown) || h->charset > toInt(Charset::Latin1)) {
+			return false;
+		}
+
+		if (sizeof(Header) + (size_t(h->nodes) * 2 + 1 + h->edges) * sizeof(uint32_t) + h->edges + h->values > s) {
+			return false;
+		}
+
+		data = d; size = s; header = h;
+		edgeRanges = (const uint32_t *)(d + sizeof(Header));
+		nodeValues = edgeRanges + h->nodes + 1;
+		edgeTargets = nodeValues + h->nodes;
+		edgeChars = (const uint8_t *)(edgeTargets + h->edges);
+		values = edgeChars + h->edges;
+
+		// validate once on load, so matcher can walk without bound checks
+		for (uint32_t i = 0; i < h->nodes; ++ i) {
+			if (edgeRanges[i] > edgeRanges[i + 1] || (nodeValues[i] && (nodeValues[i] - 1 >= h->values
+					|| nodeValues[i] - 1 + size_t(values[nodeValues[i] - 1]) >= h->values))) {
+				return false;
+			}
+		}
+		if (edgeRanges[0] != 0 || edgeRanges[h->nodes] != h->edges) {
+			return false;
+		}
+		for (uint32_t i = 0; i < h->edges; ++ i) {
+			if (edgeTargets[i] >= h->nodes) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint32_t next(uint32_t node, uint8_t c) const {
+		auto first = edgeChars + edgeRanges[node];
+		auto last = edgeChars + edgeRanges[node + 1];
+		auto it = std::lower_bound(first, last, c);
+		if (it != last && *it == c) {
+			return edgeTargets[it - edgeChars];
+		}
+		return InvalidNode;
+	}
+};
+
+static_assert(sizeof(HyphenMap::Binary::Header) == 24, "Compiled dictionary header should be packed");
+
+struct HyphenMap_PatternNode {
+	std::map<uint8_t, uint32_t> next;
+	std::vector<uint8_t> values;
+};
+
+// builds compiled dictionary from libhyphen source; dictionaries with non-standard patterns or
+// compound levels are not compiled and should be loaded with libhyphen
+static std::string HyphenMap_compileDict(const StringView &source) {
+	StringView r(source);
+	auto cset = r.readUntil<StringView::Chars<'\n', '\r'>>();
+	cset.trimChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+
+	auto charset = HyphenMap_getCharset(cset);
+	if (charset == HyphenMap::Charset::Unknown) {
+		return std::string();
+	}
+
+	uint8_t lhmin = 2;
+	uint8_t rhmin = 2;
+	std::vector<HyphenMap_PatternNode> nodes(1);
+
+	while (!r.empty()) {
+		r.skipChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+		auto line = r.readUntil<StringView::Chars<'\n', '\r'>>();
+		line.trimChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+		if (line.empty() || line.is('%')) {
+			continue;
+		}
+
+		if (line.is("LEFTHYPHENMIN") || line.is("RIGHTHYPHENMIN")) {
+			auto &target = line.is("LEFTHYPHENMIN") ? lhmin : rhmin;
+			line.skipUntil<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+			line.skipChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+			target = uint8_t(std::max(int64_t(1), std::min(int64_t(maxOf<uint8_t>()), line.readInteger().get(2))));
+			continue;
+		} else if (line.is("COMPOUNDLEFTHYPHENMIN") || line.is("COMPOUNDRIGHTHYPHENMIN")) {
+			continue; // used only on compound levels, hyphenated words have no compound separators
+		} else if (line.is("NOHYPHEN") || line.is("NEXTLEVEL") || memchr(line.data(), '/', line.size())) {
+			return std::string();
+		}
+
+		uint32_t node = 0;
+		std::vector<uint8_t> values(1, 0);
+		for (size_t i = 0; i < line.size(); ++ i) {
+			auto c = uint8_t(line[i]);
+			if (c >= '0' && c <= '9') {
+				values.back() = c - '0';
 			} else {
-				hnj_hyphen_free(it->second);
-				it->second = dict;
+				auto it = nodes[node].next.find(c);
+				if (it == nodes[node].next.end()) {
+					nodes[node].next.emplace(c, uint32_t(nodes.size()));
+					node = uint32_t(nodes.size());
+					nodes.emplace_back();
+				} else {
+					node = it->second;
+				}
+				values.push_back(0);
 			}
 		}
+
+		if (node == 0) {
+			continue;
+		} else if (values.size() > maxOf<uint8_t>()) {
+			return std::string();
+		}
+		nodes[node].values = move(values);
+	}
+
+	std::vector<uint32_t> edgeRanges; edgeRanges.reserve(nodes.size() + 1);
+	std::vector<uint32_t> nodeValues; nodeValues.reserve(nodes.size());
+	std::vector<uint32_t> edgeTargets;
+	std::vector<uint8_t> edgeChars;
+	std::vector<uint8_t> values;
+
+	for (auto &it : nodes) {
+		edgeRanges.push_back(uint32_t(edgeTargets.size()));
+		for (auto &e : it.next) {
+			edgeChars.push_back(e.first);
+			edgeTargets.push_back(e.second);
+		}
+		if (it.values.empty()) {
+			nodeValues.push_back(0);
+		} else {
+			nodeValues.push_back(uint32_t(values.size() + 1));
+			values.push_back(uint8_t(it.values.size()));
+			values.insert(values.end(), it.values.begin(), it.values.end());
+		}
 	}
+	edgeRanges.push_back(uint32_t(edgeTargets.size()));
+
+	HyphenMap::Binary::Header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = HyphenMap::Binary::Magic;
+	header.version = HyphenMap::Binary::Version;
+	header.charset = toInt(charset);
+	header.lhmin = lhmin;
+	header.rhmin = rhmin;
+	header.nodes = uint32_t(nodes.size());
+	header.edges = uint32_t(edgeTargets.size());
+	header.values = uint32_t(values.size());
+
+	std::string ret;
+	ret.append((const char *)&header, sizeof(header));
+	ret.append((const char *)edgeRanges.data(), edgeRanges.size() * sizeof(uint32_t));
+	ret.append((const char *)nodeValues.data(), nodeValues.size() * sizeof(uint32_t));
+	ret.append((const char *)edgeTargets.data(), edgeTargets.size() * sizeof(uint32_t));
+	ret.append((const char *)edgeChars.data(), edgeChars.size());
+	ret.append((const char *)values.data(), values.size());
+	return ret;
 }
-Vector<uint8_t> HyphenMap::makeWordHyphens(const char16_t *ptr, size_t len) {
-	if (len < 4 || len >= 255) {
-		return Vector<uint8_t>();
+
+// maps compiled dictionary read-only; pages are backed by file and shared between all processes, that map it
+static HyphenMap::Binary *HyphenMap_mapDict(const String &path) {
+	auto fd = ::open(path.data(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
 	}
 
-	HyphenDict *dict = nullptr;
-	for (auto &it : _dicts) {
-		if (inCharGroup(it.first, ptr[0])) {
-			dict = it.second;
-			break;
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+		::close(fd);
+		return nullptr;
+	}
+
+	auto ptr = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (ptr == MAP_FAILED) {
+		return nullptr;
+	}
+
+	auto ret = new HyphenMap::Binary;
+	if (!ret->init((const uint8_t *)ptr, size_t(st.st_size))) {
+		::munmap(ptr, size_t(st.st_size));
+		delete ret;
+		return nullptr;
+	}
+	return ret;
+}
+
+static void HyphenMap_unmapDict(const HyphenMap::Binary *binary) {
+	::munmap((void *)binary->data, binary->size);
+	delete binary;
+}
+
+// compiled file is written near the source once, when missing or older than source;
+// every process maps it after that, without parsing the patterns
+static HyphenMap::Binary *HyphenMap_loadCompiledDict(const String &file) {
+	auto path = toString(file, ".hyb");
+
+	struct stat sourceStat, compiledStat;
+	if (::stat(file.data(), &sourceStat) != 0) {
+		return nullptr;
+	}
+
+	if (::stat(path.data(), &compiledStat) == 0 && compiledStat.st_mtime >= sourceStat.st_mtime) {
+		if (auto ret = HyphenMap_mapDict(path)) {
+			return ret;
 		}
 	}
 
-	if (!dict) {
+	auto compiled = HyphenMap_compileDict(filesystem::readTextFile(file));
+	if (compiled.empty()) {
+		return nullptr;
+	}
+
+	// concurrent processes write own temporary files, rename replaces compiled file atomically
+	auto tmp = toString(path, ".", ::getpid());
+	auto fd = ::open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		messages::error("HyphenMap", "Fail to write compiled dictionary", data::Value(path));
+		return nullptr;
+	}
+
+	auto written = ::write(fd, compiled.data(), compiled.size());
+	::close(fd);
+	if (written != ssize_t(compiled.size()) || ::rename(tmp.data(), path.data()) != 0) {
+		::unlink(tmp.data());
+		messages::error("HyphenMap", "Fail to write compiled dictionary", data::Value(path));
+		return nullptr;
+	}
+
+	return HyphenMap_mapDict(path);
+}
+
+static HyphenDict *HyphenMap_loadDict(const String &file) {
+	auto source = filesystem::readTextFile(file);
+	if (source.empty()) {
+		messages::error("HyphenMap", "Fail to read dictionary", data::Value(file));
+		return nullptr;
+	}
+	return hnj_hyphen_load_data(source.data(), source.size());
+}
+
+static HyphenMap::Script HyphenMap_getScriptForGroup(CharGroupId id) {
+	switch (id) {
+	case CharGroupId::Latin: return HyphenMap::Script::Latin; break;
+	case CharGroupId::Cyrillic: return HyphenMap::Script::Cyrillic; break;
+	default: break;
+	}
+	return HyphenMap::Script::Unknown;
+}
+
+HyphenMap::Script HyphenMap::getScript(char32_t c) {
+	if (c < 0x80) {
+		return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) ? Script::Latin : Script::Unknown;
+	} else if (inCharGroup(CharGroupId::Cyrillic, c)) {
+		return Script::Cyrillic;
+	} else if (inCharGroup(CharGroupId::Latin, c)) {
+		return Script::Latin;
+	}
+	return Script::Unknown;
+}
+
+void HyphenMap::addHyphenDict(CharGroupId id, const String &file) {
+	auto script = HyphenMap_getScriptForGroup(id);
+	if (script == Script::Unknown) {
+		messages::error("HyphenMap", "Unsupported char group for dictionary", data::Value(file));
+		return;
+	}
+
+	loadDict(_scripts[toInt(script)], script, file);
+}
+
+void HyphenMap::addHyphenDict(languages::Language lang, CharGroupId id, const String &file) {
+	auto script = HyphenMap_getScriptForGroup(id);
+	if (script == Script::Unknown || lang == languages::Language::Unknown) {
+		messages::error("HyphenMap", "Unsupported language or char group for dictionary", data::Value(file));
+		return;
+	}
+
+	loadDict(_languages[toInt(lang)], script, file);
+}
+
+Vector<uint8_t> HyphenMap::makeWordHyphens(const char16_t *ptr, size_t len, languages::Language lang) {
+	if (len < 4 || len >= 255) {
 		return Vector<uint8_t>();
 	}
 
-	String word = convertWord(dict, ptr, len);
-	if (!word.empty()) {
-		Vector<char> buf; buf.resize(word.size() + 5);
+	auto entry = getDict(ptr[0], lang);
+	if (!entry) {
+		return Vector<uint8_t>();
+	}
 
-		char ** rep = nullptr;
-		int * pos = nullptr;
-		int * cut = nullptr;
-		hnj_hyphen_hyphenate2(dict, word.data(), int(word.size()), buf.data(), nullptr, &rep, &pos, &cut);
+	String word = convertWord(*entry, ptr, len);
+	if (!word.empty()) {
+		uint8_t breaks[MaxWordLength] = { 0 };
+		hyphenateEncoded(*entry, word.data(), word.size(), len, breaks);
 
 		Vector<uint8_t> ret;
-		uint8_t i = 0;
-		for (auto &it : buf) {
-			if (it > 0) {
-				if ((it - '0') % 2 == 1) {
-					ret.push_back(i + 1);
-				}
-			} else {
-				break;
+		for (size_t i = 0; i + 1 < len; ++ i) {
+			if (breaks[i]) {
+				ret.push_back(uint8_t(i + 1));
 			}
-			++ i;
 		}
 		return ret;
 	}
 	return Vector<uint8_t>();
 }
-Vector<uint8_t> HyphenMap::makeWordHyphens(const WideStringView &r) {
-	return makeWordHyphens(r.data(), r.size());
+Vector<uint8_t> HyphenMap::makeWordHyphens(const WideStringView &r, languages::Language lang) {
+	return makeWordHyphens(r.data(), r.size(), lang);
 }
 void HyphenMap::purgeHyphenDicts() {
-	for (auto &it : _dicts) {
-		hnj_hyphen_free(it.second);
+	for (auto &it : _scripts) {
+		freeDict(it);
+	}
+	for (auto &it : _languages) {
+		freeDict(it);
 	}
+	clearCachedHyphens();
 }
 
-void HyphenMap::hyphenateWord(std::ostream &stream, const StringViewUtf8 & wordReader) {
-	auto utf16 = string::toUtf16(wordReader);
+// KOI8-R codes for U+0410 - U+044F
+static constexpr uint8_t s_koi8rCyrillicTable[64] = {
+	0xE1, 0xE2, 0xF7, 0xE7, 0xE4, 0xE5, 0xF6, 0xFA, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0xEF, 0xF0,
+	0xF2, 0xF3, 0xF4, 0xF5, 0xE6, 0xE8, 0xE3, 0xFE, 0xFB, 0xFD, 0xFF, 0xF9, 0xF8, 0xFC, 0xE0, 0xF1,
+	0xC1, 0xC2, 0xD7, 0xC7, 0xC4, 0xC5, 0xD6, 0xDA, 0xC9, 0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF, 0xD0,
+	0xD2, 0xD3, 0xD4, 0xD5, 0xC6, 0xC8, 0xC3, 0xDE, 0xDB, 0xDD, 0xDF, 0xD9, 0xD8, 0xDC, 0xC0, 0xD1
+};
 
-	HyphenDict *dict = nullptr;
-	for (auto &it : _dicts) {
-		if (inCharGroup(it.first, *wordReader)) {
-			dict = it.second;
-			break;
+// encodes UTF-8 word into dictionary charset without allocations;
+// stores end byte offset of every source char in ends, returns number of chars (0 when word can not be encoded)
+static size_t HyphenMap_encodeWord(const StringView &word, HyphenMap::Charset charset, char *buf, size_t &bufLen, uint16_t *ends, size_t max) {
+	auto ptr = (const uint8_t *)word.data();
+	auto size = word.size();
+
+	size_t count = 0;
+	size_t offset = 0;
+	bufLen = 0;
+	while (offset < size) {
+		if (count >= max) {
+			return 0;
 		}
+
+		uint32_t c = ptr[offset];
+		size_t len = 1;
+		if (c >= 0x80) {
+			if ((c & 0xE0) == 0xC0 && offset + 1 < size) {
+				c = ((c & 0x1F) << 6) | (ptr[offset + 1] & 0x3F);
+				len = 2;
+			} else if ((c & 0xF0) == 0xE0 && offset + 2 < size) {
+				c = ((c & 0x0F) << 12) | ((ptr[offset + 1] & 0x3F) << 6) | (ptr[offset + 2] & 0x3F);
+				len = 3;
+			} else {
+				return 0;
+			}
+		}
+
+		if (charset == HyphenMap::Charset::Utf8) {
+			memcpy(buf + bufLen, ptr + offset, len);
+			bufLen += len;
+		} else if (c < 0x80) {
+			buf[bufLen ++] = char(c);
+		} else if (charset == HyphenMap::Charset::Latin1 && c < 0x100) {
+			buf[bufLen ++] = char(c);
+		} else if (charset == HyphenMap::Charset::Koi8r && c >= 0x410 && c < 0x450) {
+			buf[bufLen ++] = char(s_koi8rCyrillicTable[c - 0x410]);
+		} else if (charset == HyphenMap::Charset::Koi8r && c == 0x401) {
+			buf[bufLen ++] = char(0xB3);
+		} else if (charset == HyphenMap::Charset::Koi8r && c == 0x451) {
+			buf[bufLen ++] = char(0xA3);
+		} else {
+			return 0;
+		}
+
+		offset += len;
+		ends[count] = uint16_t(offset);
+		++ count;
 	}
 
-	if (!dict) {
-		stream << wordReader;
+	buf[bufLen] = 0;
+	return count;
+}
+
+void HyphenMap::hyphenateWord(std::ostream &stream, const StringViewUtf8 & wordReader, languages::Language lang) {
+	StringView word(wordReader.data(), wordReader.size());
+
+	auto entry = getDict(*wordReader, lang);
+	if (!entry || word.size() > MaxWordLength * 3) {
+		stream << word;
 		return;
 	}
 
-	auto koi = string::toKoi8r(utf16);
-	Vector<char> buf; buf.resize(koi.size() + 5);
-	char ** rep = nullptr;
-	int * pos = nullptr;
-	int * cut = nullptr;
-	hnj_hyphen_hyphenate2(const_cast<HyphenDict *>(dict), koi.data(), int(koi.size()), buf.data(), nullptr, &rep, &pos, &cut);
-	WideStringView hView(utf16);
-	int offset = 0;
-	int idx=0;
-	for (auto &it : buf) {
-		int readLen = idx-offset+1;
-		auto readIdx = WideStringView(hView.data(), readLen);
-		if (it > 0) {
-			if ((it - '0') % 2 == 1) {
-				stream << string::toUtf8(readIdx);
-				stream << string::toUtf8((char16_t) 0xAD);
-				hView += readLen;
-				offset += readLen;
+	// cache key is unique for dictionary and word
+	char keyBuf[sizeof(DictEntry *) + MaxWordLength * 3];
+	memcpy(keyBuf, &entry, sizeof(DictEntry *));
+	memcpy(keyBuf + sizeof(DictEntry *), word.data(), word.size());
+	StringView key(keyBuf, sizeof(DictEntry *) + word.size());
+
+	// every char, except for the last one, can be followed by hyphen
+	uint16_t hyphens[MaxWordLength];
+	size_t count = 0;
+	if (getCachedHyphens(key, hyphens, count)) {
+		++ _cacheHits;
+	} else {
+		++ _cacheMisses;
+
+		char encoded[MaxWordLength * 3 + 1];
+		uint16_t ends[MaxWordLength];
+		size_t encodedLen = 0;
+		auto len = HyphenMap_encodeWord(word, entry->charset, encoded, encodedLen, ends, MaxWordLength);
+		if (len == 0) {
+			stream << word;
+			return;
+		}
+
+		// break is allowed after every char with odd hyphen value, except for the last one
+		uint8_t breaks[MaxWordLength] = { 0 };
+		hyphenateEncoded(*entry, encoded, encodedLen, len, breaks);
+		for (size_t idx = 0; idx + 1 < len; ++ idx) {
+			if (breaks[idx]) {
+				hyphens[count ++] = ends[idx];
 			}
-		} else {
-			stream << string::toUtf8(readIdx);
-			break;
 		}
-		++ idx;
+
+		setCachedHyphens(key, hyphens, count);
 	}
+
+	// soft hyphens are inserted between original UTF-8 bytes, no re-encoding required
+	size_t offset = 0;
+	for (size_t i = 0; i < count; ++ i) {
+		auto end = hyphens[i];
+		stream.write(word.data() + offset, end - offset);
+		stream.write("\xC2\xAD", 2); // U+00AD
+		offset = end;
+	}
+	stream.write(word.data() + offset, word.size() - offset);
 }
 
-String HyphenMap::convertWord(HyphenDict *dict, const char16_t *ptr, size_t len) {
-	if (dict->utf8) {
-		return string::toUtf8(WideStringView(ptr, len));
-	} else {
-		if (strcmp("KOI8-R", dict->cset) == 0) {
-			return string::toKoi8r(WideStringView(ptr, len));
+const HyphenMap::DictEntry *HyphenMap::getDict(char32_t c, languages::Language lang) const {
+	auto script = getScript(c);
+	if (script == Script::Unknown) {
+		return nullptr;
+	}
+
+	if (lang != languages::Language::Unknown) {
+		auto &entry = _languages[toInt(lang)];
+		if ((entry.binary || entry.dict) && entry.script == script) {
+			return &entry;
 		}
+	}
 
-		return String();
+	auto &entry = _scripts[toInt(script)];
+	return (entry.binary || entry.dict) ? &entry : nullptr;
+}
+
+void HyphenMap::hyphenateEncoded(const DictEntry &entry, const char *word, size_t wordLen, size_t len, uint8_t *breaks) const {
+	if (entry.binary) {
+		auto &b = *entry.binary;
+
+		// Liang matching over word, framed with dots; points are indexed by byte gaps of framed word
+		uint8_t framed[MaxWordLength * 3 + 2];
+		uint8_t points[MaxWordLength * 3 + 3] = { 0 };
+		auto size = wordLen + 2;
+		framed[0] = '.';
+		for (size_t i = 0; i < wordLen; ++ i) {
+			framed[i + 1] = (word[i] >= '0' && word[i] <= '9') ? '.' : uint8_t(word[i]);
+		}
+		framed[size - 1] = '.';
+
+		for (size_t i = 0; i < size; ++ i) {
+			uint32_t node = 0;
+			for (size_t j = i; j < size; ++ j) {
+				node = b.next(node, framed[j]);
+				if (node == Binary::InvalidNode) {
+					break;
+				}
+				if (auto off = b.nodeValues[node]) {
+					auto values = b.values + off;
+					auto count = std::min(size_t(values[-1]), size + 1 - i);
+					for (size_t k = 0; k < count; ++ k) {
+						points[i + k] = std::max(points[i + k], values[k]);
+					}
+				}
+			}
+		}
+
+		// char gaps are mapped to byte gaps of encoded word, single-byte charsets use one byte per char
+		size_t offset = 0;
+		for (size_t idx = 0; idx < len; ++ idx) {
+			if (b.header->charset == toInt(Charset::Utf8)) {
+				++ offset;
+				while (offset < wordLen && (uint8_t(word[offset]) & 0xC0) == 0x80) {
+					++ offset;
+				}
+			} else {
+				offset = idx + 1;
+			}
+			breaks[idx] = (points[offset + 1] % 2 == 1 && idx + 1 >= b.header->lhmin && len - idx - 1 >= b.header->rhmin) ? 1 : 0;
+		}
+	} else if (entry.dict) {
+		char buf[MaxWordLength * 3 + 5] = { 0 };
+		char ** rep = nullptr;
+		int * pos = nullptr;
+		int * cut = nullptr;
+		hnj_hyphen_hyphenate2(entry.dict, word, int(wordLen), buf, nullptr, &rep, &pos, &cut);
+
+		// hyphen values are indexed by chars for both encodings
+		for (size_t idx = 0; idx < len; ++ idx) {
+			breaks[idx] = (buf[idx] > 0 && (buf[idx] - '0') % 2 == 1) ? 1 : 0;
+		}
+
+		// non-standard hyphenation data is allocated by libhyphen and should be released by caller
+		if (rep) {
+			for (size_t i = 0; i < wordLen; ++ i) {
+				if (rep[i]) {
+					::free(rep[i]);
+				}
+			}
+			::free(rep);
+		}
+		if (pos) {
+			::free(pos);
+		}
+		if (cut) {
+			::free(cut);
+		}
+	}
+}
+
+void HyphenMap::loadDict(DictEntry &entry, Script script, const String &file) {
+	DictEntry loaded;
+	loaded.script = script;
+
+	if (auto binary = HyphenMap_loadCompiledDict(file)) {
+		loaded.binary = binary;
+		loaded.charset = Charset(binary->header->charset);
+	} else if (auto dict = HyphenMap_loadDict(file)) {
+		loaded.dict = dict;
+		loaded.charset = HyphenMap_getCharset(StringView(dict->utf8 ? "UTF-8" : dict->cset));
+		if (loaded.charset == Charset::Unknown) {
+			messages::error("HyphenMap", "Unsupported dictionary charset", data::Value({
+				pair("file", data::Value(file)),
+				pair("charset", data::Value(dict->cset)),
+			}));
+			hnj_hyphen_free(dict);
+			return;
+		}
+	} else {
+		return;
+	}
+
+	if (entry.binary || entry.dict) {
+		freeDict(entry);
+		clearCachedHyphens();
+	}
+
+	entry = loaded;
+}
+
+void HyphenMap::freeDict(DictEntry &entry) {
+	if (entry.binary) {
+		HyphenMap_unmapDict(entry.binary);
+	}
+	if (entry.dict) {
+		hnj_hyphen_free(entry.dict);
+	}
+	entry = DictEntry();
+}
+
+bool HyphenMap::getCachedHyphens(const StringView &word, uint16_t *hyphens, size_t &count) {
+	auto &shard = _cache[std::hash<std::string_view>()(std::string_view(word.data(), word.size())) % CacheShards];
+
+	std::unique_lock<Mutex> lock(shard.mutex);
+	auto it = shard.index.find(std::string_view(word.data(), word.size()));
+	if (it == shard.index.end()) {
+		return false;
+	}
+
+	if (it->second != shard.list.begin()) {
+		shard.list.splice(shard.list.begin(), shard.list, it->second);
+	}
+
+	auto &cached = it->second->second;
+	count = std::min(cached.size(), MaxWordLength);
+	memcpy(hyphens, cached.data(), count * sizeof(uint16_t));
+	return true;
+}
+
+void HyphenMap::setCachedHyphens(const StringView &word, const uint16_t *hyphens, size_t count) {
+	auto &shard = _cache[std::hash<std::string_view>()(std::string_view(word.data(), word.size())) % CacheShards];
+
+	std::unique_lock<Mutex> lock(shard.mutex);
+	if (shard.index.find(std::string_view(word.data(), word.size())) != shard.index.end()) {
+		return;
+	}
+
+	shard.list.emplace_front(std::string(word.data(), word.size()), std::vector<uint16_t>(hyphens, hyphens + count));
+	shard.index.emplace(std::string_view(shard.list.front().first), shard.list.begin());
+
+	if (shard.list.size() > CacheShardCapacity) {
+		shard.index.erase(std::string_view(shard.list.back().first));
+		shard.list.pop_back();
+	}
+}
+
+void HyphenMap::clearCachedHyphens() {
+	for (auto &shard : _cache) {
+		std::unique_lock<Mutex> lock(shard.mutex);
+		shard.index.clear();
+		shard.list.clear();
+	}
+}
+
+String HyphenMap::convertWord(const DictEntry &entry, const char16_t *ptr, size_t len) {
+	switch (entry.charset) {
+	case Charset::Utf8: return string::toUtf8(WideStringView(ptr, len)); break;
+	case Charset::Koi8r: return string::toKoi8r(WideStringView(ptr, len)); break;
+	case Charset::Latin1: {
+		String ret; ret.reserve(len);
+		for (size_t i = 0; i < len; ++ i) {
+			if (ptr[i] >= 0x100) {
+				return String();
+			}
+			ret.push_back(char(ptr[i]));
+		}
+		return ret;
+	}
+	default: break;
 	}
+	return String();
 }
 
 NS_SA_EXT_END(lore)
@@ -24,126 +24,154 @@ THE SOFTWARE.
 
 NS_SA_EXT_BEGIN(lore)
 
-static void UnitSpineIndex_followNode(Set<int64_t> &ids, UnitSpineIndex &idx, UnitSpineIndex::Node *node, size_t &max, size_t depth = 0) {
-	if (ids.find(node->id) != ids.end()) {
-		return;
-	}
+// Spine links are computed in single iterative depth-first traversal:
+// - node depth is the depth, where node was visited first;
+// - nodes within excluded subtrees are not linked;
+// - non-page nodes on each level, except the deepest one, are linked with previous node on the same level;
+// - pages are linked in traversal order, first page is linked with unit.
+static void UnitSpineIndex_linkNodes(UnitSpineIndex &idx, UnitSpineIndex::Node *root) {
+	using Node = UnitSpineIndex::Node;
+
+	struct StackEntry {
+		Node *node;
+		uint32_t depth;
+		bool excluded;
+	};
 
-	ids.emplace(node->id);
+	std::vector<bool> visited(idx.nodes.size(), false);
+	Vector<StackEntry> stack;
+	Vector<Node *> sequence; // visited nodes out of excluded subtrees, in traversal order
+	sequence.reserve(idx.nodes.size());
 
-	node->depth = depth;
-	if (depth > max) {
-		max = depth;
-	}
+	size_t max = 0;
+	stack.emplace_back(StackEntry{root, 0, false});
+	while (!stack.empty()) {
+		auto entry = stack.back();
+		stack.pop_back();
+
+		auto slot = size_t(entry.node - idx.nodes.data());
+		if (visited[slot]) {
+			continue;
+		}
+		visited[slot] = true;
 
-	if (!node->nodes.empty()) {
-		for (auto &it : node->nodes) {
-			if (auto n = idx.getNode(it)) {
-				UnitSpineIndex_followNode(ids, idx, const_cast<UnitSpineIndex::Node *>(n), max, depth + 1);
-			}
+		auto node = entry.node;
+		node->depth = entry.depth;
+		max = std::max(max, size_t(entry.depth));
+
+		auto excluded = entry.excluded || node->excluded;
+		if (!excluded) {
+			sequence.emplace_back(node);
 		}
-	} else if (!node->unordered.empty()) {
-		for (auto &it : node->unordered) {
-			if (auto n = idx.getNode(it)) {
-				UnitSpineIndex_followNode(ids, idx, const_cast<UnitSpineIndex::Node *>(n), max, depth + 1);
+
+		auto &childs = node->nodes.empty() ? node->unordered : node->nodes;
+		for (auto it = childs.rbegin(); it != childs.rend(); ++ it) {
+			if (auto n = const_cast<Node *>(idx.getNode(*it))) {
+				stack.emplace_back(StackEntry{n, entry.depth + 1, excluded});
 			}
 		}
 	}
-}
-
-static UnitSpineIndex::Node * UnitSpineIndex_processNode(Set<int64_t> &ids, UnitSpineIndex &idx,
-		UnitSpineIndex::Node *node, UnitSpineIndex::Node *prev, size_t maxDepth) {
-	if (ids.find(node->id) != ids.end()) {
-		return prev;
-	}
-
-	ids.emplace(node->id);
 
-	if (node->excluded) {
-		return prev;
-	}
-	if (node->depth == maxDepth) {
-		if (node->type != UnitSpineIndex::Type::Page) {
-			if (prev->depth == maxDepth && node != prev) {
+	Vector<Node *> levels(max + 1, root);
+	for (auto &node : sequence) {
+		if (node->depth < max) {
+			auto prev = levels[node->depth];
+			if (node->type != UnitSpineIndex::Type::Page && prev->depth == node->depth && node != prev) {
 				prev->next = node->id;
 				node->prev = prev->id;
 			}
+			levels[node->depth] = node;
 		}
-		return node;
-	} else {
-		if (!node->nodes.empty()) {
-			for (auto &it : node->nodes) {
-				if (auto n = idx.getNode(it)) {
-					prev = UnitSpineIndex_processNode(ids, idx, const_cast<UnitSpineIndex::Node *>(n), prev, maxDepth);
-				}
-			}
-		} else if (!node->unordered.empty()) {
-			for (auto &it : node->unordered) {
-				if (auto n = idx.getNode(it)) {
-					prev = UnitSpineIndex_processNode(ids, idx, const_cast<UnitSpineIndex::Node *>(n), prev, maxDepth);
-				}
-			}
+	}
+
+	// page links are applied over level links
+	Node *prev = root;
+	for (auto &node : sequence) {
+		if (node->type == UnitSpineIndex::Type::Page) {
+			prev->next = node->id;
+			node->prev = prev->id;
+			prev = node;
 		}
 	}
-	return prev;
 }
 
-static UnitSpineIndex::Node * UnitSpineIndex_processPages(Set<int64_t> &ids, UnitSpineIndex &idx,
-		UnitSpineIndex::Node *node, UnitSpineIndex::Node *prev) {
-	if (ids.find(node->id) != ids.end()) {
-		return prev;
+// sorted ids are stored as deltas from previous id, in LEB128 varints
+static Bytes UnitSpineIndex_encodePostings(const Vector<int64_t> &ids) {
+	Bytes ret;
+	ret.reserve(ids.size() * 2);
+
+	uint64_t prev = 0;
+	for (auto &it : ids) {
+		auto delta = uint64_t(it) - prev;
+		prev = uint64_t(it);
+		do {
+			uint8_t b = delta & 0x7F;
+			delta >>= 7;
+			ret.emplace_back(delta ? uint8_t(b | 0x80) : b);
+		} while (delta);
 	}
+	return ret;
+}
 
-	ids.emplace(node->id);
-
-	if (node->excluded) {
-		return prev;
-	}
-	if (node->type == UnitSpineIndex::Type::Page) {
-		prev->next = node->id;
-		node->prev = prev->id;
-		return node;
-	} else {
-		if (!node->nodes.empty()) {
-			for (auto &it : node->nodes) {
-				if (auto n = idx.getNode(it)) {
-					prev = UnitSpineIndex_processPages(ids, idx, const_cast<UnitSpineIndex::Node *>(n), prev);
-				}
-			}
-		} else if (!node->unordered.empty()) {
-			for (auto &it : node->unordered) {
-				if (auto n = idx.getNode(it)) {
-					prev = UnitSpineIndex_processPages(ids, idx, const_cast<UnitSpineIndex::Node *>(n), prev);
-				}
-			}
+static Vector<int64_t> UnitSpineIndex_decodePostings(BytesView data) {
+	Vector<int64_t> ret;
+
+	uint64_t prev = 0;
+	uint64_t delta = 0;
+	uint32_t shift = 0;
+	for (size_t i = 0; i < data.size(); ++ i) {
+		auto b = data[i];
+		delta |= uint64_t(b & 0x7F) << shift;
+		if (b & 0x80) {
+			shift += 7;
+		} else {
+			prev += delta;
+			ret.emplace_back(int64_t(prev));
+			delta = 0;
+			shift = 0;
 		}
 	}
-	return prev;
+	return ret;
 }
 
 static void UnitSpineIndex_fillFromData(UnitSpineIndex &idx, UnitSpineIndex::Data &data) {
 	idx.nodes.reserve(data.pageObjs.size() + data.sectObjs.size() + 1);
 
+	// pages are sorted by id, so posting lists are filled in ascending order
+	std::unordered_map<std::string_view, Vector<int64_t>> postings;
 	for (auto &it : data.pageObjs.asArray()) {
+		auto id = it.getInteger("__oid");
 		auto &tags = it.getString("tags");
 		StringView(tags).split<StringView::Chars<','>>([&] (StringView &v) {
 			v.trimChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
 
 			if (!v.empty()) {
-				auto insertIt = std::lower_bound(idx.tags.begin(), idx.tags.end(), v, [] (const Pair<String, size_t> &l, const StringView &r) {
-					return l.first < r;
-				});
-				if (insertIt == idx.tags.end()) {
-					idx.tags.emplace_back(pair(v.str(), 1));
-				} else if (StringView(insertIt->first) != v) {
-					idx.tags.emplace(insertIt, pair(v.str(), 1));
-				} else {
-					++ insertIt->second;
+				auto &list = postings[std::string_view(v.data(), v.size())];
+				if (list.empty() || list.back() != id) {
+					list.emplace_back(id);
 				}
 			}
 		});
 	}
 
+	Vector<std::unordered_map<std::string_view, Vector<int64_t>>::iterator> sortedTags;
+	sortedTags.reserve(postings.size());
+	for (auto it = postings.begin(); it != postings.end(); ++ it) {
+		sortedTags.emplace_back(it);
+	}
+	std::sort(sortedTags.begin(), sortedTags.end(), [] (const auto &l, const auto &r) {
+		return l->first < r->first;
+	});
+
+	idx.tags.reserve(sortedTags.size());
+	idx.tagPages.reserve(sortedTags.size());
+	for (auto &it : sortedTags) {
+		idx.tags.emplace_back(pair(String(it->first.data(), it->first.size()), it->second.size()));
+		idx.tagPages.emplace_back(UnitSpineIndex_encodePostings(it->second));
+	}
+
+	idx.slots.reserve(data.pageObjs.size() + data.sectObjs.size() + 1);
+
 	auto pageIt = data.pageObjs.asArray().begin();
 	auto sectIt = data.sectObjs.asArray().begin();
 
@@ -154,6 +182,7 @@ static void UnitSpineIndex_fillFromData(UnitSpineIndex &idx, UnitSpineIndex::Dat
 
 		idx.nodes.emplace_back(UnitSpineIndex::Node{data.getInteger("__oid"), root ? root : (sect ? sect : unit), 0, 0, type});
 		auto &n = idx.nodes.back();
+		idx.slots.emplace(n.id, uint32_t(idx.nodes.size() - 1));
 
 		n.data = move(data);
 
@@ -175,7 +204,7 @@ static void UnitSpineIndex_fillFromData(UnitSpineIndex &idx, UnitSpineIndex::Dat
 		auto &dict = n.data.asDict();
 		auto it = dict.begin();
 		while (it != dict.end()) {
-			if (it->first != "title" && it->first != "name" && it->first != "priority") {
+			if (it->first != "title" && it->first != "name" && it->first != "priority" && it->first != "tags") {
 				it = dict.erase(it);
 			} else {
 				++ it;
@@ -231,24 +260,19 @@ static void UnitSpineIndex_fillFromData(UnitSpineIndex &idx, UnitSpineIndex::Dat
 		}
 	}
 
-	auto root = const_cast<UnitSpineIndex::Node *>(idx.getNode(idx.unit));
-
-	Set<int64_t> ids;
-
-	size_t max = 0;
-	UnitSpineIndex_followNode(ids, idx, root, max);
-
-	for (size_t i = 0; i < max; ++ i) {
-		ids.clear();
-		UnitSpineIndex_processNode(ids, idx, root, root, i);
+	if (auto root = const_cast<UnitSpineIndex::Node *>(idx.getNode(idx.unit))) {
+		UnitSpineIndex_linkNodes(idx, root);
 	}
+}
 
-	ids.clear();
-	UnitSpineIndex_processPages(ids, idx, root, root);
-
-	for (auto &it : idx.nodes) {
-		it.writeEncoded();
+// latest mtime of loaded objects; time of build can not be used here, objects can be written with earlier mtime after it
+static int64_t UnitSpineIndex_getMaxMTime(const data::Value &objs, int64_t mtime) {
+	if (objs.isArray()) {
+		for (auto &it : objs.asArray()) {
+			mtime = std::max(mtime, it.getInteger("mtime"));
+		}
 	}
+	return mtime;
 }
 
 static void UnitSpineIndex_load(UnitSpineIndex &idx) {
@@ -263,15 +287,206 @@ static void UnitSpineIndex_load(UnitSpineIndex &idx) {
 			.select("project", data::Value(idx.unit)).order("__oid", storage::Ordering::Ascending)
 			.include("order", "options", "section", "title", "priority", "tags"));
 
+	idx.mtime = UnitSpineIndex_getMaxMTime(data.pageObjs, UnitSpineIndex_getMaxMTime(data.sectObjs, 0));
+
 	UnitSpineIndex_fillFromData(idx, data);
 }
 
-static void UnitSpineIndex_get(UnitSpineIndex &idx) {
-	if (auto data = idx.units->get(idx.storage, idx.unit, {"spine"})) {
+static_assert(sizeof(UnitSpineIndex::BinaryHeader) == 40, "Spine header should keep int64 columns aligned");
+
+// sets column pointers for binary spine, returns false if blob is invalid or truncated
+static bool UnitSpineIndex_layout(UnitSpineIndex::Columns &cols, const uint8_t *base, size_t size) {
+	using Header = UnitSpineIndex::BinaryHeader;
+
+	if (size < sizeof(Header)) {
+		return false;
+	}
+
+	auto h = (const Header *)base;
+	if (h->magic != UnitSpineIndex::BinaryMagic || h->version != UnitSpineIndex::BinaryVersion) {
+		return false;
+	}
+
+	const size_t count = h->count;
+	const size_t required = sizeof(Header) + count * sizeof(int64_t) * 5 + size_t(h->links) * sizeof(int64_t)
+			+ (count + 1) * sizeof(uint32_t) * 2 + count * sizeof(uint32_t) * 6
+			+ count * sizeof(uint16_t) + count * 2 + h->strings;
+	if (size < required) {
+		return false;
+	}
+
+	auto ptr = base + sizeof(Header);
+	auto take = [&] (size_t n) {
+		auto ret = ptr;
+		ptr += n;
+		return ret;
+	};
+
+	cols.count = h->count;
+	cols.ids = (const int64_t *)take(count * sizeof(int64_t));
+	cols.parents = (const int64_t *)take(count * sizeof(int64_t));
+	cols.prevs = (const int64_t *)take(count * sizeof(int64_t));
+	cols.nexts = (const int64_t *)take(count * sizeof(int64_t));
+	cols.priorities = (const int64_t *)take(count * sizeof(int64_t));
+	cols.links = (const int64_t *)take(h->links * sizeof(int64_t));
+	cols.ordered = (const uint32_t *)take((count + 1) * sizeof(uint32_t));
+	cols.unordered = (const uint32_t *)take((count + 1) * sizeof(uint32_t));
+	cols.titleOffsets = (const uint32_t *)take(count * sizeof(uint32_t));
+	cols.titleSizes = (const uint32_t *)take(count * sizeof(uint32_t));
+	cols.nameOffsets = (const uint32_t *)take(count * sizeof(uint32_t));
+	cols.nameSizes = (const uint32_t *)take(count * sizeof(uint32_t));
+	cols.tagsOffsets = (const uint32_t *)take(count * sizeof(uint32_t));
+	cols.tagsSizes = (const uint32_t *)take(count * sizeof(uint32_t));
+	cols.depths = (const uint16_t *)take(count * sizeof(uint16_t));
+	cols.types = take(count);
+	cols.flags = take(count);
+	cols.strings = (const char *)take(h->strings);
+
+	if (cols.ordered[count] > h->links || cols.unordered[count] > h->links) {
+		return false;
+	}
+
+	return true;
+}
+
+static Bytes UnitSpineIndex_encodeBinary(const UnitSpineIndex &idx) {
+	using Header = UnitSpineIndex::BinaryHeader;
+
+	size_t nlinks = 0;
+	String strings;
+	for (auto &it : idx.nodes) {
+		nlinks += it.nodes.size() + it.unordered.size();
+		strings.append(it.data.getString("title"));
+		strings.append(it.data.getString("name"));
+		strings.append(it.data.getString("tags"));
+	}
+
+	const size_t count = idx.nodes.size();
+	const size_t size = sizeof(Header) + count * sizeof(int64_t) * 5 + nlinks * sizeof(int64_t)
+			+ (count + 1) * sizeof(uint32_t) * 2 + count * sizeof(uint32_t) * 6
+			+ count * sizeof(uint16_t) + count * 2 + strings.size();
+
+	Bytes ret; ret.resize(size);
+
+	auto h = (Header *)ret.data();
+	h->magic = UnitSpineIndex::BinaryMagic;
+	h->version = UnitSpineIndex::BinaryVersion;
+	h->flags = 0;
+	h->count = uint32_t(count);
+	h->links = uint32_t(nlinks);
+	h->strings = uint32_t(strings.size());
+	h->reserved = 0;
+	h->unit = idx.unit;
+	h->mtime = idx.mtime;
+
+	// layout is shared with decoder, columns are written through the same pointers
+	UnitSpineIndex::Columns cols;
+	UnitSpineIndex_layout(cols, ret.data(), ret.size());
+	const_cast<uint32_t *>(cols.ordered)[count] = uint32_t(nlinks);
+	const_cast<uint32_t *>(cols.unordered)[count] = uint32_t(nlinks);
+
+	uint32_t link = 0;
+	uint32_t str = 0;
+	for (size_t i = 0; i < count; ++ i) {
+		auto &n = idx.nodes[i];
+		auto &title = n.data.getString("title");
+		auto &name = n.data.getString("name");
+		auto &tags = n.data.getString("tags");
+
+		const_cast<int64_t *>(cols.ids)[i] = n.id;
+		const_cast<int64_t *>(cols.parents)[i] = n.parent;
+		const_cast<int64_t *>(cols.prevs)[i] = n.prev;
+		const_cast<int64_t *>(cols.nexts)[i] = n.next;
+		const_cast<int64_t *>(cols.priorities)[i] = n.data.getInteger("priority");
+
+		const_cast<uint32_t *>(cols.ordered)[i] = link;
+		for (auto &it : n.nodes) { const_cast<int64_t *>(cols.links)[link ++] = it; }
+		const_cast<uint32_t *>(cols.unordered)[i] = link;
+		for (auto &it : n.unordered) { const_cast<int64_t *>(cols.links)[link ++] = it; }
+
+		const_cast<uint32_t *>(cols.titleOffsets)[i] = str;
+		const_cast<uint32_t *>(cols.titleSizes)[i] = uint32_t(title.size());
+		str += title.size();
+		const_cast<uint32_t *>(cols.nameOffsets)[i] = str;
+		const_cast<uint32_t *>(cols.nameSizes)[i] = uint32_t(name.size());
+		str += name.size();
+		const_cast<uint32_t *>(cols.tagsOffsets)[i] = str;
+		const_cast<uint32_t *>(cols.tagsSizes)[i] = uint32_t(tags.size());
+		str += tags.size();
+
+		const_cast<uint16_t *>(cols.depths)[i] = uint16_t(std::min(n.depth, size_t(maxOf<uint16_t>())));
+		const_cast<uint8_t *>(cols.types)[i] = uint8_t(toInt(n.type));
+		const_cast<uint8_t *>(cols.flags)[i] = n.excluded ? 1 : 0;
+	}
+
+	memcpy(const_cast<char *>(cols.strings), strings.data(), strings.size());
+	return ret;
+}
+
+static void UnitSpineIndex_getTags(UnitSpineIndex &idx, const data::Value &tags) {
+	if (tags.isArray()) {
+		idx.tags.reserve(tags.asArray().size());
+		for (auto &it : tags.asArray()) {
+			idx.tags.emplace_back(pair(it.getString(0), it.getInteger(1)));
+		}
+	}
+}
+
+// binary spine is not decoded, nodes are read from columns on demand
+static void UnitSpineIndex_setStored(UnitSpineIndex &idx, std::shared_ptr<const WikiComponent::CachedSpine> &&stored) {
+	idx.stored = move(stored);
+
+	auto &bin = idx.stored->bin;
+	if (!UnitSpineIndex_layout(idx.columns, (const uint8_t *)bin.data(), bin.size())) {
+		idx.columns = UnitSpineIndex::Columns();
+	} else {
+		idx.mtime = ((const UnitSpineIndex::BinaryHeader *)bin.data())->mtime;
+	}
+
+	idx.tags.reserve(idx.stored->tags.size());
+	for (auto &it : idx.stored->tags) {
+		idx.tags.emplace_back(pair(String(it.first.data(), it.first.size()), it.second));
+	}
+	idx.stale = idx.stored->stale;
+}
+
+static void UnitSpineIndex_get(UnitSpineIndex &idx, const WikiComponent *wiki) {
+	// recently verified cache entry is used without storage access
+	if (auto cached = wiki->getCachedSpine(idx.unit)) {
+		UnitSpineIndex_setStored(idx, move(cached));
+		return;
+	}
+
+	// project mtime is changed with every spine or spineStale write, so it's used as cache version
+	auto mtime = idx.units->get(idx.storage, idx.unit, {"mtime"}).getInteger("mtime");
+	if (!mtime) {
+		return;
+	}
+
+	if (auto cached = wiki->getCachedSpine(idx.unit, mtime)) {
+		UnitSpineIndex_setStored(idx, move(cached));
+		return;
+	}
+
+	auto data = idx.units->get(idx.storage, idx.unit, {"spine", "spineStale"});
+	if (data) {
 		if (!data.isDictionary("spine")) {
+			// first spine is not built yet, it's loaded without storing, until rebuild on heartbeat
+			UnitSpineIndex_load(idx);
+			idx.stale = true;
+			return;
+		}
+
+		if (data.getValue("spine").isBytes("bin")) {
+			auto stored = std::make_shared<const WikiComponent::CachedSpine>(data.getValue("spine"), data.getInteger("spineStale") != 0);
+			if (data.getInteger("mtime") == mtime) {
+				wiki->setCachedSpine(idx.unit, mtime, stored);
+			}
+			UnitSpineIndex_setStored(idx, move(stored));
 			return;
 		}
 
+		// previous format, dictionary per node
 		auto &spine = data.getValue("spine");
 		auto &nodes = spine.getValue("nodes");
 		if (nodes.isArray()) {
@@ -281,42 +496,112 @@ static void UnitSpineIndex_get(UnitSpineIndex &idx) {
 			}
 		}
 
-		auto &tags = spine.getValue("tags");
-		if (tags.isArray()) {
-			idx.tags.reserve(tags.asArray().size());
-			for (auto &it : tags.asArray()) {
-				idx.tags.emplace_back(pair(it.getString(0), it.getInteger(1)));
-			}
-		}
+		UnitSpineIndex_getTags(idx, spine.getValue("tags"));
 	}
 }
 
-void UnitSpineIndex::Node::writeEncoded() {
-	data.setInteger(id, "id");
-	data.setInteger(parent, "root");
-	data.setInteger(next, "next");
-	data.setInteger(prev, "prev");
-	data.setInteger(depth, "depth");
-	switch (type) {
-	case UnitSpineIndex::Type::Unit: data.setString("unit", "type"); break;
-	case UnitSpineIndex::Type::Section: data.setString("section", "type"); break;
-	case UnitSpineIndex::Type::Page: data.setString("page", "type"); break;
+// restores source object for unchanged node, as it was loaded for previous build
+static data::Value UnitSpineIndex_restoreObject(const UnitSpineIndex::NodeView &v) {
+	data::Value ret;
+	ret.setInteger(v.getId(), "__oid");
+	ret.setInteger(v.getParent(), (v.getType() == UnitSpineIndex::Type::Page) ? "section" : "root");
+	ret.setString(v.getTitle(), "title");
+	ret.setString(v.getName(), "name");
+	if (auto p = v.getPriority()) {
+		ret.setInteger(p, "priority");
+	}
+	if (!v.getTags().empty()) {
+		ret.setString(v.getTags(), "tags");
 	}
-	data.setBool(excluded, "ex");
 
-	if (!nodes.empty()) {
-		auto &content = data.emplace("ord");
-		for (auto &n_it : nodes) {
-			content.addInteger(n_it);
+	auto ord = v.getOrdered();
+	if (!ord.empty()) {
+		auto &o = ret.emplace("order");
+		for (auto &it : ord) {
+			o.addInteger(it);
 		}
 	}
 
-	if (!unordered.empty()) {
-		auto &content = data.emplace("uord");
-		for (auto &n_it : unordered) {
-			content.addInteger(n_it);
+	if (v.isExcluded()) {
+		ret.emplace("options").setBool(true, "excludedFromSpine");
+	}
+	return ret;
+}
+
+// merges list of object ids with changed objects and nodes of previous spine;
+// returns false, if object is not changed, but missed in previous spine
+static bool UnitSpineIndex_mergeObjects(const UnitSpineIndex &prev, UnitSpineIndex::Type type,
+		data::Value &all, data::Value &changed, data::Value &target) {
+	target = data::Value(data::Value::Type::ARRAY);
+	if (!all.isArray()) {
+		return true;
+	}
+
+	if (!changed.isArray()) {
+		changed = data::Value(data::Value::Type::ARRAY);
+	}
+
+	auto cIt = changed.asArray().begin();
+	auto cEnd = changed.asArray().end();
+
+	for (auto &it : all.asArray()) {
+		auto id = it.getInteger("__oid");
+		while (cIt != cEnd && cIt->getInteger("__oid") < id) {
+			++ cIt;
+		}
+
+		if (cIt != cEnd && cIt->getInteger("__oid") == id) {
+			target.addValue(move(*cIt));
+			++ cIt;
+		} else if (auto v = prev.getNodeView(id)) {
+			if (v.getType() != type) {
+				return false;
+			}
+			target.addValue(UnitSpineIndex_restoreObject(v));
+		} else {
+			return false;
 		}
 	}
+	return true;
+}
+
+// objects, written within SpineMTimeMargin before previous build mtime, are loaded again,
+// so changes from transactions, committed after the build, but with earlier mtime, are not lost
+static constexpr int64_t SpineMTimeMargin = 10'000'000; // microseconds
+
+static bool UnitSpineIndex_update(UnitSpineIndex &idx, const UnitSpineIndex &prev) {
+	auto since = data::Value(prev.mtime - SpineMTimeMargin);
+
+	UnitSpineIndex::Data data;
+	data.unit = idx.units->get(idx.storage, idx.unit, {"order", "name", "title"});
+	if (!data.unit) {
+		return false;
+	}
+
+	// removed objects are just not listed, new and modified ones are loaded completely
+	auto sectIds = idx.sections->select(idx.storage, storage::Query()
+			.select("project", data::Value(idx.unit)).order("__oid", storage::Ordering::Ascending).include("__oid"));
+	auto sectChanged = idx.sections->select(idx.storage, storage::Query()
+			.select("project", data::Value(idx.unit)).select("mtime", storage::Comparation::GreatherOrEqual, since)
+			.order("__oid", storage::Ordering::Ascending)
+			.include("order", "options", "root", "title", "priority", "tags"));
+
+	auto pageIds = idx.pages->select(idx.storage, storage::Query()
+			.select("project", data::Value(idx.unit)).order("__oid", storage::Ordering::Ascending).include("__oid"));
+	auto pageChanged = idx.pages->select(idx.storage, storage::Query()
+			.select("project", data::Value(idx.unit)).select("mtime", storage::Comparation::GreatherOrEqual, since)
+			.order("__oid", storage::Ordering::Ascending)
+			.include("order", "options", "section", "title", "priority", "tags"));
+
+	idx.mtime = UnitSpineIndex_getMaxMTime(pageChanged, UnitSpineIndex_getMaxMTime(sectChanged, prev.mtime));
+
+	if (!UnitSpineIndex_mergeObjects(prev, UnitSpineIndex::Type::Section, sectIds, sectChanged, data.sectObjs)
+			|| !UnitSpineIndex_mergeObjects(prev, UnitSpineIndex::Type::Page, pageIds, pageChanged, data.pageObjs)) {
+		return false;
+	}
+
+	UnitSpineIndex_fillFromData(idx, data);
+	return true;
 }
 
 UnitSpineIndex::Node UnitSpineIndex::Node::decode(data::Value &&data) {
@@ -399,7 +684,27 @@ UnitSpineIndex UnitSpineIndex::get(const Request &req, int64_t unit) {
 	ret.sections = &h->getSections();
 	ret.pages = &h->getPages();
 
-	UnitSpineIndex_get(ret);
+	UnitSpineIndex_get(ret, h);
+
+	return ret;
+}
+
+UnitSpineIndex UnitSpineIndex::update(const storage::Transaction &t, int64_t unit) {
+	auto prev = get(t, unit);
+	if (prev.columns.count == 0) {
+		return create(t, unit);
+	}
+
+	UnitSpineIndex ret;
+	ret.unit = unit;
+	ret.storage = t;
+	ret.units = prev.units;
+	ret.sections = prev.sections;
+	ret.pages = prev.pages;
+
+	if (!UnitSpineIndex_update(ret, prev)) {
+		return create(t, unit);
+	}
 
 	return ret;
 }
@@ -415,35 +720,132 @@ UnitSpineIndex UnitSpineIndex::get(const storage::Transaction &t, int64_t unit)
 	ret.sections = &h->getSections();
 	ret.pages = &h->getPages();
 
-	UnitSpineIndex_get(ret);
+	UnitSpineIndex_get(ret, h);
 
 	return ret;
 }
 
+UnitSpineIndex::Links UnitSpineIndex::NodeView::getOrdered() const {
+	auto b = columns->ordered[slot];
+	return Links{columns->links + b, columns->unordered[slot] - b};
+}
+
+UnitSpineIndex::Links UnitSpineIndex::NodeView::getUnordered() const {
+	auto b = columns->unordered[slot];
+	return Links{columns->links + b, columns->ordered[slot + 1] - b};
+}
+
 const UnitSpineIndex::Node *UnitSpineIndex::getNode(int64_t id) const {
-	auto it = std::lower_bound(nodes.begin(), nodes.end(), id, [] (const Node &l, const int64_t &r) {
-		return l.id < r;
-	});
-	if (it != nodes.end()) {
-		return &(*it);
+	if (!slots.empty()) {
+		auto it = slots.find(id);
+		if (it != slots.end()) {
+			return &nodes[it->second];
+		}
+		return nullptr;
+	}
+
+	if (!nodes.empty()) {
+		auto it = std::lower_bound(nodes.begin(), nodes.end(), id, [] (const Node &l, const int64_t &r) {
+			return l.id < r;
+		});
+		if (it != nodes.end() && it->id == id) {
+			return &(*it);
+		}
+		return nullptr;
+	}
+
+	auto it = decoded.find(id);
+	if (it != decoded.end()) {
+		return &it->second;
+	}
+
+	if (auto v = getNodeView(id)) {
+		Node n;
+		n.id = v.getId();
+		n.parent = v.getParent();
+		n.prev = v.getPrev();
+		n.next = v.getNext();
+		n.type = v.getType();
+		n.excluded = v.isExcluded();
+		n.depth = v.getDepth();
+
+		auto ord = v.getOrdered();
+		n.nodes.assign(ord.begin(), ord.end());
+		auto uord = v.getUnordered();
+		n.unordered.assign(uord.begin(), uord.end());
+
+		n.data.setString(v.getTitle(), "title");
+		n.data.setString(v.getName(), "name");
+		if (!v.getTags().empty()) {
+			n.data.setString(v.getTags(), "tags");
+		}
+		if (auto p = v.getPriority()) {
+			n.data.setInteger(p, "priority");
+		}
+
+		return &decoded.emplace(id, move(n)).first->second;
 	}
 	return nullptr;
 }
 
+UnitSpineIndex::NodeView UnitSpineIndex::getNodeView(int64_t id) const {
+	if (!columns.count) {
+		return NodeView();
+	}
+
+	auto end = columns.ids + columns.count;
+	auto it = std::lower_bound(columns.ids, end, id);
+	if (it != end && *it == id) {
+		return NodeView{&columns, uint32_t(it - columns.ids)};
+	}
+	return NodeView();
+}
+
+size_t UnitSpineIndex::size() const {
+	return nodes.empty() ? columns.count : nodes.size();
+}
+
+Vector<int64_t> UnitSpineIndex::getTagPages(const StringView &tag) const {
+	auto it = std::lower_bound(tags.begin(), tags.end(), tag, [] (const Pair<String, size_t> &l, const StringView &r) {
+		return StringView(l.first) < r;
+	});
+	if (it == tags.end() || StringView(it->first) != tag) {
+		return Vector<int64_t>();
+	}
+
+	auto i = size_t(it - tags.begin());
+	if (i < tagPages.size()) {
+		return UnitSpineIndex_decodePostings(tagPages[i]);
+	}
+
+	// loaded spine, postings are read from stored one
+	if (stored && i < stored->postings.size()) {
+		auto &postings = stored->postings[i];
+		return UnitSpineIndex_decodePostings(BytesView((const uint8_t *)postings.data(), postings.size()));
+	}
+	return Vector<int64_t>();
+}
+
 data::Value UnitSpineIndex::encode() const {
 	data::Value ret;
-
-	ret.setInteger(unit, "unit");
-	auto &nodesVal = ret.emplace("nodes");
-	for (auto &it : nodes) {
-		nodesVal.addValue(it.data);
+	if (nodes.empty() && stored) {
+		ret.setBytes(Bytes((const uint8_t *)stored->bin.data(), (const uint8_t *)stored->bin.data() + stored->bin.size()), "bin");
+	} else {
+		ret.setBytes(UnitSpineIndex_encodeBinary(*this), "bin");
 	}
 
+	// [tag, pages count, encoded page ids]
 	auto &tagsVal = ret.emplace("tags");
-	for (auto &it : tags) {
+	for (size_t i = 0; i < tags.size(); ++ i) {
 		auto &v = tagsVal.emplace();
-		v.addString(it.first);
-		v.addInteger(it.second);
+		v.addString(tags[i].first);
+		v.addInteger(tags[i].second);
+		if (i < tagPages.size()) {
+			v.addBytes(Bytes(tagPages[i]));
+		} else if (stored && i < stored->postings.size()) {
+			auto &postings = stored->postings[i];
+			v.addBytes(Bytes((const uint8_t *)postings.data(), (const uint8_t *)postings.data() + postings.size()));
+		}
 	}
 
 	return ret;
@@ -75,6 +75,7 @@ void UsersComponent::init(const LoreComponent *db) {
 			return false;
 		})),
 		Field::Integer("origin"),
+		Field::Integer("grantsVersion", Flags::Protected), // changed on every wiki grants write for user
 		Field::Set("providers", _authProviders),
 		Field::Object("lastProvider", _authProviders, storage::Flags::Reference, Flags::Protected),
 		Field::FullTextView("ts", FullTextViewFn([this] (const Scheme &scheme, const data::Value &obj) -> Vector<FullTextData> {